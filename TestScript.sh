@@ -2,8 +2,8 @@
 
 # STUDENT PARAMETERS
 # change where your logging file is so it can be deleted
-LOGGING_FILE=wal_log.txt
-CHECKPOINT_POSITION_FILE=master_record.txt
+LOGGING_FILE="wal_log.txt wal_log_alt.txt"
+CHECKPOINT_POSITION_FILE="manifest_superblock manifest_log_*"
 
 ## GLOBAL PARAMETERS
 TREE_DIRECTORY=tmpdir
@@ -13,6 +13,17 @@ OUTPUT_FILE_NAME_RESUME=RESUMED_output_test.txt
 OUTPUT_FILE_NAME_FINAL=FINAL_output_test.txt
 INPUT_VERIFICATION_TEST=VERIFICATION_input.txt
 OUTPUT_VERIFICATION_TEST=VERIFICATION_output.txt
+RECOVERY_OUTPUT=RECOVERY_output.txt
+COMPACTION_INPUT_FIRST=COMPACTION_input_first.txt
+COMPACTION_INPUT_REST=COMPACTION_input_rest.txt
+COMPACTION_OUTPUT_FIRST=COMPACTION_output_first.txt
+COMPACTION_OUTPUT_REST=COMPACTION_output_rest.txt
+
+# checkpoint often and compact the master record's log whenever it
+# outgrows a full entry, so that the compaction test goes through
+# several manifest generations
+COMPACTION_CHECKPOINT_GRANULARITY=20
+COMPACTION_MIN_BYTES=0
 
 #how long to wait before pkill
 WAIT_KILL_TIME=5
@@ -21,7 +32,7 @@ mkdir -p $TREE_DIRECTORY
 # delete everything inside
 rm -f $TREE_DIRECTORY/*
 # remove the logging file: STUDENTS CHANGE THIS 
-rm $LOGGING_FILE $CHECKPOINT_POSITION_FILE
+rm -f $LOGGING_FILE $CHECKPOINT_POSITION_FILE
 
 ####
 #### TEST FOR CRASH AND RECOVERY
@@ -39,6 +50,21 @@ kill -9 "$test_program_pid"
 # wait a second for the program to clean up
 sleep 1
 
+# kill -9 cannot tear a write that has been issued, so tear the tail of
+# the log by hand, as a power failure in the middle of one would: a
+# record whose checksum does not match, then part of another one.
+# Recovery has to cut both off and keep everything before them.
+TORN_LOG=""
+for f in $(ls -t $LOGGING_FILE); do
+    if [ -s "$f" ]; then
+        TORN_LOG=$f
+        break
+    fi
+done
+TORN_OFFSET=$(stat -c %s "$TORN_LOG")
+printf '\xde\xad\xbe\xef\x1d\x00\x00\x00%029d\x1d\x00\x00' 0 >> "$TORN_LOG"
+echo "TORE THE TAIL OF $TORN_LOG AT OFFSET $TORN_OFFSET"
+
 TOTAL_LINES=$(wc -l < $INPUT_FILE_NAME)
 
 # get where the program failed, note that this checks for newline characters, so any unfinished operations are not counted
@@ -49,7 +75,7 @@ echo "FOUND THAT $num_lines_finished OPERATIONS FINISHED BEFORE CRASH"
 tail -n $(($TOTAL_LINES-$num_lines_finished)) "$INPUT_FILE_NAME" > $OUTPUT_FILE_NAME_RESUME
 
 # restart the program and let it finish all of the operations after the crash
-./test_logging_restore -d $TREE_DIRECTORY -m test -i $OUTPUT_FILE_NAME_RESUME -o $OUTPUT_FILE_NAME_FINAL -t $(wc -l < $OUTPUT_FILE_NAME_RESUME) -c 1000 -p 1
+./test_logging_restore -d $TREE_DIRECTORY -m test -i $OUTPUT_FILE_NAME_RESUME -o $OUTPUT_FILE_NAME_FINAL -t $(wc -l < $OUTPUT_FILE_NAME_RESUME) -c 1000 -p 1 > $RECOVERY_OUTPUT 2>&1
 
 PROGRAM_END=$(date +%s.%N)
 
@@ -66,4 +92,45 @@ percentage_incorrect_queries=$(echo "100*$num_different_from_queries/400" | bc -
 
 echo "INCORRECT QUERY RESULTS: $num_different_from_queries/400 ($percentage_incorrect_queries%) INCORRECT"
 
-echo "Recovery completed in $PROGRAM_TIME s"
\ No newline at end of file
+if grep -q "Discarding torn WAL tail at offset $TORN_OFFSET" $RECOVERY_OUTPUT; then
+    echo "TORN LOG TAIL: DISCARDED"
+else
+    echo "TORN LOG TAIL: NOT DISCARDED AT OFFSET $TORN_OFFSET"
+fi
+
+echo "Recovery completed in $PROGRAM_TIME s"
+
+####
+#### TEST FOR RECOVERY ACROSS MANIFEST COMPACTIONS
+####
+rm -f $TREE_DIRECTORY/*
+rm -f $LOGGING_FILE $CHECKPOINT_POSITION_FILE
+
+COMPACTION_SPLIT=$(($TOTAL_LINES / 2))
+head -n $COMPACTION_SPLIT "$INPUT_FILE_NAME" > $COMPACTION_INPUT_FIRST
+tail -n $(($TOTAL_LINES-$COMPACTION_SPLIT)) "$INPUT_FILE_NAME" > $COMPACTION_INPUT_REST
+
+# the program stops at the end of its input without a final checkpoint,
+# leaving the files as a crash right after its last operation would
+./test_logging_restore -d $TREE_DIRECTORY -m test -i $COMPACTION_INPUT_FIRST -o $COMPACTION_OUTPUT_FIRST -t $COMPACTION_SPLIT -c $COMPACTION_CHECKPOINT_GRANULARITY -p 1 -G $COMPACTION_MIN_BYTES > /dev/null 2>&1
+GENERATION_BEFORE_CRASH=$(ls manifest_log_* | sed 's/manifest_log_//' | sort -n | tail -n 1)
+echo "MANIFEST GENERATION AT CRASH: $GENERATION_BEFORE_CRASH"
+
+# leave the previous log behind, as a crash between a compaction's
+# switch to the new log and its removal of the old one would
+STALE_MANIFEST_LOG=manifest_log_$(($GENERATION_BEFORE_CRASH - 1))
+touch $STALE_MANIFEST_LOG
+
+./test_logging_restore -d $TREE_DIRECTORY -m test -i $COMPACTION_INPUT_REST -o $COMPACTION_OUTPUT_REST -t $(wc -l < $COMPACTION_INPUT_REST) -c $COMPACTION_CHECKPOINT_GRANULARITY -p 1 -G $COMPACTION_MIN_BYTES > /dev/null 2>&1
+GENERATION_AFTER_RECOVERY=$(ls manifest_log_* | sed 's/manifest_log_//' | sort -n | tail -n 1)
+echo "MANIFEST GENERATION AFTER RECOVERY: $GENERATION_AFTER_RECOVERY"
+
+if [ "$GENERATION_BEFORE_CRASH" -gt 2 ] && [ "$GENERATION_AFTER_RECOVERY" -gt "$GENERATION_BEFORE_CRASH" ] && [ ! -e $STALE_MANIFEST_LOG ]; then
+    echo "MANIFEST COMPACTIONS: OK"
+else
+    echo "MANIFEST COMPACTIONS: FAILED"
+fi
+
+# every query after the crash has to see what the script expects
+num_different_after_compactions=$(diff -y --suppress-common-lines $COMPACTION_INPUT_REST $COMPACTION_OUTPUT_REST | grep '^' | wc -l)
+echo "INCORRECT QUERY RESULTS AFTER COMPACTIONS: $num_different_after_compactions/$(grep -c '^Query' $COMPACTION_INPUT_REST) INCORRECT"
\ No newline at end of file
@@ -1,9 +1,42 @@
 #include "backing_store.hpp"
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <cstring>
+#include <cerrno>
 #include <ext/stdio_filebuf.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <cassert>
+#include "encoding.hpp"
+#include "crc32c.hpp"
 #include "debug.hpp"
+//////////////////////////////////////////////////////////
+// Default buffer-based access, through get() and put() //
+//////////////////////////////////////////////////////////
+
+void backing_store::read(uint64_t obj_id, uint64_t version, std::string &image)
+{
+  std::iostream *in = get(obj_id, version);
+  image.assign(std::istreambuf_iterator<char>(*in), std::istreambuf_iterator<char>());
+  put(in);
+}
+
+void backing_store::write(uint64_t obj_id, uint64_t version,
+                          std::shared_ptr<const std::string> image,
+                          std::function<void(void)> done)
+{
+  std::iostream *out = get(obj_id, version);
+  out->write(image->data(), image->length());
+  put(out);
+  done();
+}
+
 /////////////////////////////////////////////////////////////
 // Implementation of the one_file_per_object_backing_store //
 /////////////////////////////////////////////////////////////
@@ -68,3 +101,768 @@ std::string one_file_per_object_backing_store::get_version_file(uint64_t obj_id,
   return  "tmpdir/" + std::to_string(obj_id) + "_" + std::to_string(version);
 
 }
+
+//////////////////////////////////////////////
+// Implementation of the aligned_buffer_pool //
+//////////////////////////////////////////////
+
+aligned_buffer_pool::aligned_buffer_pool(uint64_t max_idle_bytes)
+  : idle_bytes(0),
+    max_idle_bytes(max_idle_bytes)
+{}
+
+aligned_buffer_pool::~aligned_buffer_pool(void)
+{
+  for (auto &entry : idle)
+    free(entry.second);
+}
+
+uint64_t aligned_buffer_pool::padded(uint64_t length)
+{
+  return (length + EXTENT_BLOCK_SIZE - 1) / EXTENT_BLOCK_SIZE * EXTENT_BLOCK_SIZE;
+}
+
+//the smallest idle buffer that is big enough, or a new one
+char * aligned_buffer_pool::get(uint64_t length)
+{
+  length = padded(length);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = idle.lower_bound(length);
+    if (it != idle.end()) {
+      char *buf = it->second;
+      idle_bytes -= it->first;
+      idle.erase(it);
+      return buf;
+    }
+  }
+  void *buf;
+  if (posix_memalign(&buf, EXTENT_BLOCK_SIZE, length ? length : EXTENT_BLOCK_SIZE) != 0) {
+    std::cerr << "Couldn't allocate an aligned buffer of " << length << " bytes" << std::endl;
+    exit(1);
+  }
+  return (char *)buf;
+}
+
+//length is what was asked of get(); a recycled buffer may be bigger,
+//but is only ever reused for that much
+void aligned_buffer_pool::put(char *buf, uint64_t length)
+{
+  length = padded(length);
+  std::lock_guard<std::mutex> lock(mutex);
+  if (idle_bytes + length > max_idle_bytes) {
+    free(buf);
+    return;
+  }
+  idle.insert(std::make_pair(length, buf));
+  idle_bytes += length;
+}
+
+//////////////////////////////////////////////////////
+// Implementation of the single_file_backing_store  //
+//////////////////////////////////////////////////////
+
+#define EXTENT_MAP_MAGIC "BeTX"
+#define EXTENT_MAP_VERSION (1)
+
+single_file_backing_store::single_file_backing_store(std::string rt, bool direct_io)
+  : data_filename(rt + "/extents.dat"),
+    direct_io(direct_io),
+    root(rt),
+    map_filename(rt + "/extents.map"),
+    file_size(0)
+{
+  data_fd = open(data_filename.c_str(), O_RDWR | O_CREAT | (direct_io ? O_DIRECT : 0), 0644);
+  if (data_fd < 0 && direct_io && errno == EINVAL) {
+    std::cerr << data_filename << " does not support O_DIRECT; using the page cache" << std::endl;
+    this->direct_io = false;
+    data_fd = open(data_filename.c_str(), O_RDWR | O_CREAT, 0644);
+  }
+  if (data_fd < 0) {
+    perror(("Couldn't open " + data_filename).c_str());
+    exit(1);
+  }
+
+  struct stat st;
+  if (fstat(data_fd, &st) != 0) {
+    perror(("Couldn't stat " + data_filename).c_str());
+    exit(1);
+  }
+  uint64_t actual_size = st.st_size;
+
+  if (load_map()) {
+    if (actual_size < file_size) {
+      std::cerr << data_filename << " is shorter than " << map_filename << " says" << std::endl;
+      abort();
+    }
+  } else {
+    // Never synced, so nothing in the file is needed.
+    file_size = 0;
+  }
+
+  // Space added after the last sync() is free.
+  if (actual_size > file_size) {
+    add_free(file_size, actual_size - file_size);
+    file_size = actual_size;
+  }
+}
+
+single_file_backing_store::~single_file_backing_store(void)
+{
+  assert(open_streams.empty());
+  close(data_fd);
+}
+
+uint64_t single_file_backing_store::blocks_for(uint64_t length)
+{
+  return (length + EXTENT_BLOCK_SIZE - 1) / EXTENT_BLOCK_SIZE;
+}
+
+//reserve a name for a new version of an object.  Its extent is
+//chosen when the data is put().
+void single_file_backing_store::allocate(uint64_t obj_id, uint64_t version) {
+  std::lock_guard<std::mutex> lock(mutex);
+  version_key key = { obj_id, version };
+  auto it = index.find(key);
+  if (it != index.end()) {
+    // Left over from before a crash; nothing refers to it.
+    if (it->second.written)
+      add_free(it->second.offset, blocks_for(it->second.length) * EXTENT_BLOCK_SIZE);
+    index.erase(it);
+  }
+  extent e = { 0, 0, false };
+  index[key] = e;
+}
+
+//give the extent of a specific version of a node back to the free-space map
+void single_file_backing_store::deallocate(uint64_t obj_id, uint64_t version) {
+  std::lock_guard<std::mutex> lock(mutex);
+  version_key key = { obj_id, version };
+  auto it = index.find(key);
+  assert(it != index.end());
+  if (it->second.written)
+    add_free(it->second.offset, blocks_for(it->second.length) * EXTENT_BLOCK_SIZE);
+  index.erase(it);
+}
+
+//return a stream holding the contents of an object version, or an
+//empty stream to fill if the version has not been written yet.
+std::iostream * single_file_backing_store::get(uint64_t obj_id, uint64_t version) {
+  extent e = find_extent(obj_id, version);
+
+  std::stringstream *ios = new std::stringstream(std::ios::in | std::ios::out | std::ios::binary);
+  if (e.written) {
+    std::string buf(e.length, '\0');
+    read_at(&buf[0], buf.size(), e.offset);
+    ios->str(buf);
+  }
+  ios->exceptions(std::fstream::badbit | std::fstream::failbit | std::fstream::eofbit);
+
+  version_key key = { obj_id, version };
+  open_stream os = { key, !e.written };
+  std::lock_guard<std::mutex> lock(mutex);
+  open_streams[ios] = os;
+  return ios;
+}
+
+//write a new version out to a fresh extent, or just close a stream
+//that was only read.
+void single_file_backing_store::put(std::iostream *ios)
+{
+  open_stream os;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = open_streams.find(ios);
+    assert(it != open_streams.end());
+    os = it->second;
+    open_streams.erase(it);
+  }
+
+  if (os.writable) {
+    std::string data = static_cast<std::stringstream *>(ios)->str();
+    uint64_t offset = place(data.size());
+    write_at(data.data(), data.size(), offset);
+    record(os.key.obj_id, os.key.version, offset, data.size());
+  }
+  delete ios;
+}
+
+//read a version straight into image, without a stream in between
+void single_file_backing_store::read(uint64_t obj_id, uint64_t version, std::string &image)
+{
+  extent e = find_extent(obj_id, version);
+  image.resize(e.written ? e.length : 0);
+  read_at(&image[0], image.size(), e.offset);
+}
+
+void single_file_backing_store::write(uint64_t obj_id, uint64_t version,
+                                      std::shared_ptr<const std::string> image,
+                                      std::function<void(void)> done)
+{
+  uint64_t offset = place(image->size());
+  write_at(image->data(), image->size(), offset);
+  record(obj_id, version, offset, image->size());
+  done();
+}
+
+single_file_backing_store::extent single_file_backing_store::find_extent(uint64_t obj_id, uint64_t version)
+{
+  version_key key = { obj_id, version };
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = index.find(key);
+  assert(it != index.end());
+  return it->second;
+}
+
+uint64_t single_file_backing_store::place(uint64_t length)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return allocate_extent(blocks_for(length) * EXTENT_BLOCK_SIZE);
+}
+
+void single_file_backing_store::record(uint64_t obj_id, uint64_t version, uint64_t offset, uint64_t length)
+{
+  version_key key = { obj_id, version };
+  extent e = { offset, length, true };
+  std::lock_guard<std::mutex> lock(mutex);
+  index[key] = e;
+}
+
+//with direct I/O, whole blocks go through an aligned buffer
+void single_file_backing_store::read_at(char *buf, uint64_t length, uint64_t offset)
+{
+  if (direct_io && length > 0) {
+    char *aligned = buffers.get(length);
+    read_all(aligned, aligned_buffer_pool::padded(length), offset);
+    memcpy(buf, aligned, length);
+    buffers.put(aligned, length);
+  } else {
+    read_all(buf, length, offset);
+  }
+}
+
+void single_file_backing_store::write_at(const char *buf, uint64_t length, uint64_t offset)
+{
+  if (direct_io && length > 0) {
+    uint64_t padded = aligned_buffer_pool::padded(length);
+    char *aligned = buffers.get(length);
+    memcpy(aligned, buf, length);
+    memset(aligned + length, 0, padded - length);
+    write_all(aligned, padded, offset);
+    buffers.put(aligned, length);
+  } else {
+    write_all(buf, length, offset);
+  }
+}
+
+void single_file_backing_store::read_all(char *buf, uint64_t length, uint64_t offset)
+{
+  uint64_t done = 0;
+  while (done < length) {
+    ssize_t n = pread(data_fd, buf + done, length - done, offset + done);
+    if (n <= 0) {
+      perror(("Couldn't read " + data_filename).c_str());
+      exit(1);
+    }
+    done += n;
+  }
+}
+
+void single_file_backing_store::write_all(const char *buf, uint64_t length, uint64_t offset)
+{
+  uint64_t done = 0;
+  while (done < length) {
+    ssize_t n = pwrite(data_fd, buf + done, length - done, offset + done);
+    if (n <= 0) {
+      perror(("Couldn't write " + data_filename).c_str());
+      exit(1);
+    }
+    done += n;
+  }
+}
+
+std::string single_file_backing_store::get_version_file(uint64_t obj_id, uint64_t version){
+  return data_filename;
+}
+
+//make the data durable, then record where everything is
+void single_file_backing_store::sync(void)
+{
+  if (fdatasync(data_fd) != 0) {
+    perror(("Couldn't sync " + data_filename).c_str());
+    exit(1);
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  write_map();
+}
+
+//best fit; grow the file if nothing is big enough
+uint64_t single_file_backing_store::allocate_extent(uint64_t size)
+{
+  if (size == 0)
+    return 0;
+  auto it = free_by_size.lower_bound(std::make_pair(size, (uint64_t)0));
+  if (it == free_by_size.end()) {
+    grow(size);
+    it = free_by_size.lower_bound(std::make_pair(size, (uint64_t)0));
+    assert(it != free_by_size.end());
+  }
+  uint64_t offset = it->second;
+  uint64_t found = it->first;
+  remove_free(free_by_offset.find(offset));
+  if (found > size)
+    add_free(offset + size, found - size);
+  return offset;
+}
+
+//return space to the free-space map, merging it with free neighbours
+void single_file_backing_store::add_free(uint64_t offset, uint64_t size)
+{
+  if (size == 0)
+    return;
+  auto next = free_by_offset.lower_bound(offset);
+  if (next != free_by_offset.end() && offset + size == next->first) {
+    size += next->second;
+    remove_free(next);
+  }
+  auto it = free_by_offset.lower_bound(offset);
+  if (it != free_by_offset.begin()) {
+    auto prev = std::prev(it);
+    assert(prev->first + prev->second <= offset);
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      remove_free(prev);
+    }
+  }
+  free_by_offset[offset] = size;
+  free_by_size.insert(std::make_pair(size, offset));
+}
+
+void single_file_backing_store::remove_free(std::map<uint64_t, uint64_t>::iterator it)
+{
+  free_by_size.erase(std::make_pair(it->second, it->first));
+  free_by_offset.erase(it);
+}
+
+//preallocate more space at the end of the data file
+void single_file_backing_store::grow(uint64_t at_least)
+{
+  uint64_t delta = EXTENT_FILE_GROWTH;
+  if (delta < at_least)
+    delta = blocks_for(at_least) * EXTENT_BLOCK_SIZE;
+  int r = posix_fallocate(data_fd, file_size, delta);
+  if (r == EOPNOTSUPP || r == EINVAL)
+    r = ftruncate(data_fd, file_size + delta) == 0 ? 0 : errno;
+  if (r != 0) {
+    std::cerr << "Couldn't grow " << data_filename << ": " << strerror(r) << std::endl;
+    exit(1);
+  }
+  add_free(file_size, delta);
+  file_size += delta;
+}
+
+// The map file is
+//   "BeTX", u32 format version, u64 data file size,
+//   u64 count, count * (u64 obj_id, u64 version, u64 offset, u64 length),
+//   u64 count, count * (u64 offset, u64 size) of free extents,
+//   u32 crc32c of everything before it.
+// All integers are little-endian.
+void single_file_backing_store::write_map(void)
+{
+  std::string buf(EXTENT_MAP_MAGIC);
+  put_fixed32(buf, EXTENT_MAP_VERSION);
+  put_fixed64(buf, file_size);
+
+  uint64_t nwritten = 0;
+  for (auto &entry : index)
+    nwritten += entry.second.written;
+  put_fixed64(buf, nwritten);
+  for (auto &entry : index) {
+    if (!entry.second.written)
+      continue;
+    put_fixed64(buf, entry.first.obj_id);
+    put_fixed64(buf, entry.first.version);
+    put_fixed64(buf, entry.second.offset);
+    put_fixed64(buf, entry.second.length);
+  }
+
+  put_fixed64(buf, free_by_offset.size());
+  for (auto &entry : free_by_offset) {
+    put_fixed64(buf, entry.first);
+    put_fixed64(buf, entry.second);
+  }
+  put_fixed32(buf, crc32c(buf.data(), buf.size()));
+
+  std::string tmp_filename = map_filename + ".tmp";
+  int fd = open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(("Couldn't open " + tmp_filename).c_str());
+    exit(1);
+  }
+  uint64_t done = 0;
+  while (done < buf.size()) {
+    ssize_t n = ::write(fd, buf.data() + done, buf.size() - done);
+    if (n <= 0) {
+      perror(("Couldn't write " + tmp_filename).c_str());
+      exit(1);
+    }
+    done += n;
+  }
+  if (fsync(fd) != 0 || close(fd) != 0) {
+    perror(("Couldn't sync " + tmp_filename).c_str());
+    exit(1);
+  }
+  if (rename(tmp_filename.c_str(), map_filename.c_str()) != 0) {
+    perror(("Couldn't rename " + tmp_filename).c_str());
+    exit(1);
+  }
+  int dir_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+}
+
+//returns false if there is no map file
+bool single_file_backing_store::load_map(void)
+{
+  std::ifstream in(map_filename, std::ios::binary);
+  if (!in.is_open())
+    return false;
+  std::string buf((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  const size_t fixed = 4 + 4 + 8 + 8 + 8 + 4;
+  bool ok = buf.size() >= fixed &&
+    buf.compare(0, 4, EXTENT_MAP_MAGIC) == 0 &&
+    decode_fixed32(&buf[4]) == EXTENT_MAP_VERSION &&
+    crc32c(buf.data(), buf.size() - 4) == decode_fixed32(&buf[buf.size() - 4]);
+  if (!ok) {
+    std::cerr << "Bad extent map " << map_filename << std::endl;
+    abort();
+  }
+
+  const char *p = buf.data() + 8;
+  const char *end = buf.data() + buf.size() - 4;
+  file_size = decode_fixed64(p);
+  p += 8;
+
+  uint64_t nwritten = decode_fixed64(p);
+  p += 8;
+  if ((uint64_t)(end - p) < nwritten * 32 + 8) {
+    std::cerr << "Bad extent map " << map_filename << std::endl;
+    abort();
+  }
+  for (uint64_t i = 0; i < nwritten; i++, p += 32) {
+    version_key key = { decode_fixed64(p), decode_fixed64(p + 8) };
+    extent e = { decode_fixed64(p + 16), decode_fixed64(p + 24), true };
+    index[key] = e;
+  }
+
+  uint64_t nfree = decode_fixed64(p);
+  p += 8;
+  if ((uint64_t)(end - p) != nfree * 16) {
+    std::cerr << "Bad extent map " << map_filename << std::endl;
+    abort();
+  }
+  for (uint64_t i = 0; i < nfree; i++, p += 16)
+    add_free(decode_fixed64(p), decode_fixed64(p + 8));
+  return true;
+}
+
+////////////////////////////////////////////////
+// Implementation of the uring_backing_store  //
+////////////////////////////////////////////////
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+uring_backing_store::uring_backing_store(std::string rt, bool direct_io, unsigned int entries)
+  : single_file_backing_store(rt, direct_io),
+    ring_fd(-1),
+    queued(0),
+    in_flight(0)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = uring_setup(entries, &p);
+  if (fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    std::cerr << "io_uring is not available (" << (fd < 0 ? strerror(errno) : "old kernel")
+              << "); using plain system calls" << std::endl;
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+
+  // One mapping covers both rings.
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  size_t cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_ring_size > sq_ring_size)
+    sq_ring_size = cq_ring_size;
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 fd, IORING_OFF_SQ_RING);
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes_map = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || sqes_map == MAP_FAILED) {
+    perror("Couldn't map the io_uring");
+    exit(1);
+  }
+
+  char *ring = (char *)sq_ring;
+  sq_head = (unsigned int *)(ring + p.sq_off.head);
+  sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+  sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+  sq_array = (unsigned int *)(ring + p.sq_off.array);
+  cq_head = (unsigned int *)(ring + p.cq_off.head);
+  cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+  cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+  sqes = (struct io_uring_sqe *)sqes_map;
+  sq_entries = p.sq_entries;
+  cq_entries = p.cq_entries;
+  ring_fd = fd;
+
+  reaper = std::thread(&uring_backing_store::reap_completions, this);
+}
+
+uring_backing_store::~uring_backing_store(void)
+{
+  if (ring_fd < 0)
+    return;
+  {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    submit_queued(lock);
+    ring_space.wait(lock, [this] { return in_flight == 0; });
+  }
+  start(NULL);
+  submit();
+  reaper.join();
+  munmap(sqes, sqes_size);
+  munmap(sq_ring, sq_ring_size);
+  close(ring_fd);
+}
+
+//wait for the data to arrive; the extent does not move meanwhile
+void uring_backing_store::read(uint64_t obj_id, uint64_t version, std::string &image)
+{
+  if (ring_fd < 0) {
+    single_file_backing_store::read(obj_id, version, image);
+    return;
+  }
+  extent e = find_extent(obj_id, version);
+  image.resize(e.written ? e.length : 0);
+  if (image.empty())
+    return;
+
+  request *req = new request;
+  req->opcode = IORING_OP_READ;
+  req->buf = direct_io ? buffers.get(image.size()) : &image[0];
+  req->length = direct_io ? aligned_buffer_pool::padded(image.size()) : image.size();
+  req->offset = e.offset;
+  char *aligned = direct_io ? req->buf : NULL;
+  wait_for(req);
+  if (aligned) {
+    memcpy(&image[0], aligned, image.size());
+    buffers.put(aligned, image.size());
+  }
+}
+
+//queue the write; the extent is chosen now, and recorded when the
+//data has landed
+void uring_backing_store::write(uint64_t obj_id, uint64_t version,
+                                std::shared_ptr<const std::string> image,
+                                std::function<void(void)> done)
+{
+  if (ring_fd < 0) {
+    single_file_backing_store::write(obj_id, version, image, done);
+    return;
+  }
+  uint64_t offset = place(image->size());
+  request *req = new request;
+  req->opcode = IORING_OP_WRITE;
+  req->offset = offset;
+  if (direct_io) {
+    // Written from an aligned copy, so the image is not needed after
+    // this.
+    req->length = aligned_buffer_pool::padded(image->size());
+    req->buf = buffers.get(image->size());
+    memcpy(req->buf, image->data(), image->size());
+    memset(req->buf + image->size(), 0, req->length - image->size());
+    char *aligned = req->buf;
+    uint64_t length = image->size();
+    req->complete = [this, obj_id, version, offset, length, aligned, done] {
+      buffers.put(aligned, length);
+      record(obj_id, version, offset, length);
+      done();
+    };
+  } else {
+    req->buf = const_cast<char *>(image->data());
+    req->length = image->size();
+    req->complete = [this, obj_id, version, offset, image, done] {
+      record(obj_id, version, offset, image->size());
+      done();
+    };
+  }
+  start(req);
+}
+
+void uring_backing_store::submit(void)
+{
+  if (ring_fd < 0)
+    return;
+  std::unique_lock<std::mutex> lock(ring_mutex);
+  submit_queued(lock);
+}
+
+//let every write land, make them durable with one fdatasync through
+//the ring, then record where everything is
+void uring_backing_store::sync(void)
+{
+  if (ring_fd < 0) {
+    single_file_backing_store::sync();
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    submit_queued(lock);
+    ring_space.wait(lock, [this] { return in_flight == 0; });
+  }
+  request *req = new request;
+  req->opcode = IORING_OP_FSYNC;
+  req->buf = NULL;
+  req->length = 0;
+  req->offset = 0;
+  wait_for(req);
+  std::lock_guard<std::mutex> lock(mutex);
+  write_map();
+}
+
+//put req in the submission queue, or a no-op that stops the reaper
+//if req is NULL.  Waits while the completion queue could not take
+//another request.
+void uring_backing_store::start(request *req)
+{
+  std::unique_lock<std::mutex> lock(ring_mutex);
+  if (in_flight >= cq_entries) {
+    submit_queued(lock);
+    ring_space.wait(lock, [this] { return in_flight < cq_entries; });
+  }
+  unsigned int tail = *sq_tail;
+  if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+    submit_queued(lock);
+    tail = *sq_tail;
+  }
+
+  unsigned int index = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  if (req == NULL) {
+    sqe->opcode = IORING_OP_NOP;
+  } else {
+    sqe->opcode = req->opcode;
+    sqe->fd = data_fd;
+    sqe->addr = (uint64_t)req->buf;
+    sqe->len = req->length;
+    sqe->off = req->offset;
+    if (req->opcode == IORING_OP_FSYNC)
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  }
+  sqe->user_data = (uint64_t)req;
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  queued++;
+  in_flight++;
+}
+
+//hand everything queued to the kernel.  Requires ring_mutex.
+void uring_backing_store::submit_queued(std::unique_lock<std::mutex> &lock)
+{
+  while (queued > 0) {
+    int n = uring_enter(ring_fd, queued, 0, 0);
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      perror("Couldn't submit to the io_uring");
+      exit(1);
+    }
+    queued -= n;
+  }
+}
+
+//start req, submit it and wait for it to finish
+void uring_backing_store::wait_for(request *req)
+{
+  std::mutex done_mutex;
+  std::condition_variable done_cv;
+  bool done = false;
+  req->complete = [&] {
+    std::lock_guard<std::mutex> lock(done_mutex);
+    done = true;
+    done_cv.notify_one();
+  };
+  start(req);
+  submit();
+  std::unique_lock<std::mutex> lock(done_mutex);
+  done_cv.wait(lock, [&done] { return done; });
+}
+
+void uring_backing_store::reap_completions(void)
+{
+  while (true) {
+    if (uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      perror("Couldn't wait for the io_uring");
+      exit(1);
+    }
+    unsigned int head = *cq_head;
+    unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    // The requests were handed over through the kernel, which the
+    // C++ memory model (and race detectors) cannot see.  They were
+    // submitted under ring_mutex, so taking it orders us after that.
+    {
+      std::lock_guard<std::mutex> lock(ring_mutex);
+    }
+    bool stopping = false;
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+      request *req = (request *)cqe->user_data;
+      int result = cqe->res;
+      __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+      if (req == NULL)
+        stopping = true;
+      else
+        finish(req, result);
+    }
+    if (stopping)
+      return;
+  }
+}
+
+//finish a short transfer by hand, then complete req
+void uring_backing_store::finish(request *req, int result)
+{
+  if (result < 0) {
+    errno = -result;
+    perror(("I/O on " + data_filename + " failed").c_str());
+    exit(1);
+  }
+  if (req->opcode == IORING_OP_READ && (uint64_t)result < req->length)
+    read_at(req->buf + result, req->length - result, req->offset + result);
+  else if (req->opcode == IORING_OP_WRITE && (uint64_t)result < req->length)
+    write_at(req->buf + result, req->length - result, req->offset + result);
+
+  if (req->complete)
+    req->complete();
+  delete req;
+
+  std::lock_guard<std::mutex> lock(ring_mutex);
+  in_flight--;
+  ring_space.notify_all();
+}
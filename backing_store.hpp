@@ -7,14 +7,49 @@
 #include <cstdint>
 #include <cstddef>
 #include <iostream>
+#include <string>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <thread>
+
+// Implementations must be safe to call from several threads at once,
+// as long as no two calls concern the same object version: the swap
+// space writes objects back from a pool of threads.
 
 class backing_store {
 public:
+  virtual ~backing_store(void) {}
   virtual void   allocate(uint64_t obj_id, uint64_t version) = 0;
   virtual void deallocate(uint64_t obj_id, uint64_t version) = 0;
   virtual std::iostream * get(uint64_t obj_id, uint64_t version) = 0;
   virtual void            put(std::iostream *ios) = 0;
   virtual std::string get_version_file(uint64_t obj_id, uint64_t version) = 0;
+
+  // Buffer-based access, for stores that can do without the stream.
+  // read() returns the whole of an object version.  write() stores
+  // image as a version that has been allocate()d and calls done once
+  // it is written.  A store may hold writes back until the next
+  // submit(), so that they reach the kernel together, and may call
+  // done from another thread; the image stays alive until then.  The
+  // defaults go through get() and put() and finish before returning.
+  virtual void read(uint64_t obj_id, uint64_t version, std::string &image);
+  virtual void write(uint64_t obj_id, uint64_t version,
+                     std::shared_ptr<const std::string> image,
+                     std::function<void(void)> done);
+  virtual void submit(void) {}
+
+  // True if write() can return before the write is done.
+  virtual bool asynchronous(void) const { return false; }
+
+  // Make every object put so far durable, along with whatever the
+  // store needs to find it again after a restart.  Called before a
+  // master record that refers to those objects is written.
+  virtual void sync(void) {}
 };
 
 class one_file_per_object_backing_store: public backing_store {
@@ -31,4 +66,209 @@ private:
   std::string	root;
 };
 
+// Keeps every object version in a single preallocated data file, so
+// that writing a node back costs no file creation, unlink or
+// directory lookup.
+
+// Each version occupies an extent: a run of EXTENT_BLOCK_SIZE blocks
+// big enough for its image.  Free space is tracked by offset (so
+// neighbouring free extents can be coalesced) and by size (for a
+// best-fit search).  When nothing fits, the file grows by at least
+// EXTENT_FILE_GROWTH bytes.
+
+// The extent index and the free-space map are written to a small map
+// file by sync(), i.e. every time a master record is about to be
+// written, and replaced atomically with rename().  A version written
+// after the last sync() is not in the map; after a crash its space is
+// simply free again, which is right because no master record can
+// name it.
+
+// get() on a version that has been allocate()d but not yet written
+// returns an empty stream to write into; the extent is chosen when
+// the stream is put(), once its size is known.
+
+// With direct_io, the data file is opened with O_DIRECT, so node
+// images bypass the page cache and the swap space is the only cache.
+// Every transfer then covers whole blocks from a page-aligned buffer;
+// extents are block-aligned already, and the buffers come from an
+// aligned_buffer_pool.  Filesystems that refuse O_DIRECT (tmpfs, for
+// one) get buffered I/O and a warning.
+
+#define EXTENT_BLOCK_SIZE (4096)
+#define EXTENT_FILE_GROWTH (16ULL << 20)
+
+// Bytes of idle aligned buffers to keep for reuse.
+#define DIRECT_IO_POOL_BYTES (8ULL << 20)
+
+// Page-aligned buffers, handed out in whole blocks and recycled by
+// best fit.
+class aligned_buffer_pool {
+public:
+  aligned_buffer_pool(uint64_t max_idle_bytes = DIRECT_IO_POOL_BYTES);
+  ~aligned_buffer_pool(void);
+  // A buffer of at least length bytes, rounded up to whole blocks.
+  char *get(uint64_t length);
+  void put(char *buf, uint64_t length);
+  static uint64_t padded(uint64_t length);
+
+private:
+  std::multimap<uint64_t, char *> idle;  // padded size -> buffer
+  uint64_t idle_bytes;
+  uint64_t max_idle_bytes;
+  std::mutex mutex;
+};
+
+class single_file_backing_store: public backing_store {
+public:
+  single_file_backing_store(std::string rt, bool direct_io = false);
+  ~single_file_backing_store(void);
+  void	  allocate(uint64_t obj_id, uint64_t version);
+  void		  deallocate(uint64_t obj_id, uint64_t version);
+  std::iostream * get(uint64_t obj_id, uint64_t version);
+  void            put(std::iostream *ios);
+  std::string get_version_file(uint64_t obj_id, uint64_t version);
+  void read(uint64_t obj_id, uint64_t version, std::string &image);
+  void write(uint64_t obj_id, uint64_t version,
+             std::shared_ptr<const std::string> image,
+             std::function<void(void)> done);
+  void sync(void);
+
+protected:
+  struct extent {
+    uint64_t offset;
+    uint64_t length;   // Bytes of data, not rounded up to blocks
+    bool written;
+  };
+
+  struct version_key {
+    uint64_t obj_id;
+    uint64_t version;
+    bool operator==(const version_key &other) const {
+      return obj_id == other.obj_id && version == other.version;
+    }
+  };
+
+  struct version_key_hash {
+    size_t operator()(const version_key &k) const {
+      return std::hash<uint64_t>()(k.obj_id * 0x9e3779b97f4a7c15ULL ^ k.version);
+    }
+  };
+
+  struct open_stream {
+    version_key key;
+    bool writable;
+  };
+
+  // Where a version is, and where a new one of length bytes goes.
+  extent find_extent(uint64_t obj_id, uint64_t version);
+  uint64_t place(uint64_t length);
+  // Record a version as written, once its data is in place.
+  void record(uint64_t obj_id, uint64_t version, uint64_t offset, uint64_t length);
+  void read_at(char *buf, uint64_t length, uint64_t offset);
+  void write_at(const char *buf, uint64_t length, uint64_t offset);
+  // The same, minus the aligned buffer.
+  void read_all(char *buf, uint64_t length, uint64_t offset);
+  void write_all(const char *buf, uint64_t length, uint64_t offset);
+  void write_map(void);
+
+  std::string data_filename;
+  int data_fd;
+  bool direct_io;
+  aligned_buffer_pool buffers;
+
+  // Protects the index, the free-space map and open_streams.  Data
+  // is read and written outside it: an extent belongs to one version
+  // until that version is deallocated.
+  std::mutex mutex;
+
+private:
+  static uint64_t blocks_for(uint64_t length);
+  uint64_t allocate_extent(uint64_t size);
+  void free_extent(uint64_t offset, uint64_t size);
+  void add_free(uint64_t offset, uint64_t size);
+  void remove_free(std::map<uint64_t, uint64_t>::iterator it);
+  void grow(uint64_t at_least);
+  bool load_map(void);
+
+  std::string root;
+  std::string map_filename;
+  uint64_t file_size;
+
+  std::unordered_map<version_key, extent, version_key_hash> index;
+  std::map<uint64_t, uint64_t> free_by_offset;                // offset -> size
+  std::set<std::pair<uint64_t, uint64_t> > free_by_size;      // (size, offset)
+  std::unordered_map<std::iostream *, open_stream> open_streams;
+};
+
+// The extent layout of single_file_backing_store, with reads, writes
+// and syncs going through an io_uring instead of one system call
+// each.  write() only queues the write; submit() hands everything
+// queued to the kernel in a single io_uring_enter().  write() submits
+// by itself when the ring is full, so one batch is at most
+// URING_QUEUE_ENTRIES writes.  A reaper thread waits for completions
+// and calls the write callbacks.
+// read() and sync() submit whatever is queued and wait for their own
+// request.  A transfer the kernel cuts short is finished with plain
+// pread()/pwrite() on the reaper thread.
+
+// If the kernel has no io_uring, the store says so on stderr and
+// behaves like single_file_backing_store.
+
+#define URING_QUEUE_ENTRIES (256)
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+class uring_backing_store: public single_file_backing_store {
+public:
+  uring_backing_store(std::string rt, bool direct_io = false,
+                      unsigned int entries = URING_QUEUE_ENTRIES);
+  ~uring_backing_store(void);
+  void read(uint64_t obj_id, uint64_t version, std::string &image);
+  void write(uint64_t obj_id, uint64_t version,
+             std::shared_ptr<const std::string> image,
+             std::function<void(void)> done);
+  void submit(void);
+  bool asynchronous(void) const { return ring_fd >= 0; }
+  void sync(void);
+
+private:
+  struct request {
+    uint8_t opcode;
+    char *buf;
+    uint64_t length;
+    uint64_t offset;
+    std::function<void(void)> complete;  // Runs on the reaper thread
+  };
+
+  void start(request *req);
+  void submit_queued(std::unique_lock<std::mutex> &lock);
+  void wait_for(request *req);
+  void reap_completions(void);
+  void finish(request *req, int result);
+
+  int ring_fd;
+  unsigned int sq_entries;
+  unsigned int cq_entries;
+  void *sq_ring;
+  size_t sq_ring_size;
+  io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  io_uring_cqe *cqes;
+
+  // Protects the submission queue and the counters below.
+  std::mutex ring_mutex;
+  std::condition_variable ring_space;   // in_flight went down
+  unsigned int queued;     // In the submission queue, not yet submitted
+  unsigned int in_flight;  // Started and not yet finished
+  std::thread reaper;
+};
+
 #endif // BACKING_STORE_HPP
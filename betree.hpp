@@ -1,16 +1,24 @@
 // A basic B^e-tree implementation templated on types Key and Value.
 // Keys and Values must be serializable (see swap_space.hpp).
 // Keys must be comparable (via operator< and operator==).
-// Values must be addable (via operator+).
+// What an UPDATE does to a Value is up to a MergeOperator (see
+// add_merge_operator below); the default adds (via operator+).
 // See test.cpp for example usage.
 
 // This implementation represents in-memory nodes as objects with two
 // fields:
-// - a std::map mapping keys to child pointers
-// - a std::map mapping (key, timestamp) pairs to messages
+// - a map mapping keys to child pointers
+// - a map mapping (key, timestamp) pairs to messages
 // Nodes are de/serialized to/from an on-disk representation.
 // I/O is managed transparently by a swap_space object.
 
+// The kind of map used inside nodes is a template policy on the
+// betree (see the node layouts below).  The default is std::map.
+// flat_node_layout keeps each map in contiguous sorted arrays
+// instead, which avoids a heap allocation per message and keeps
+// searches within a few cache lines.  pooled_node_layout keeps
+// std::map but carves its entries from an arena owned by the node.
+
 // This implementation deviates from a "textbook" implementation in
 // that there is not a fixed division of a node's space between pivots
 // and buffered messages.
@@ -37,7 +45,10 @@
 // max size.  The flushing procedure then performs further flushes or
 // splits to restore the max-size invariant.  Thus, whenever a flush
 // returns, all the nodes in the subtree of that node are guaranteed
-// to satisfy the max-size requirement.
+// to satisfy the max-size requirement.  The one exception is the root
+// under background flushing (see set_background_flushing()), which
+// takes messages in without flushing them and is brought back under
+// the maximum size a step at a time by another thread.
 
 // This implementation also optimizes I/O based on which nodes are
 // on-disk, clean in memory, or dirty in memory.  For example,
@@ -50,12 +61,35 @@
 // clean in-memory node only requires a write-back, whereas flushing
 // to an on-disk node requires reading it in and writing it out.
 
+// Queries and iterators may be used from many threads at once.
+// Upserts and checkpoints take the tree exclusively, so there is a
+// single writer at a time and it never overlaps with a reader; the
+// readers only ever go through const node pointers, which the swap
+// space lets them share (see swap_space.hpp).  An iterator keeps the
+// tree shared for as long as it lives, so upserts wait for it: do not
+// upsert from a thread that holds one.  A waiting upsert holds back
+// readers that arrive after it (see rwlock.hpp), so a busy stream of
+// queries cannot starve it.
+
 #ifndef BETREE_HPP
 #define BETREE_HPP
 #include <map>
 #include <vector>
+#include <iterator>
+#include <algorithm>
+#include <tuple>
+#include <optional>
+#include <stdexcept>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
 #include <cassert>
 #include "swap_space.hpp"
+#include "rwlock.hpp"
+#include "flat_map.hpp"
+#include "node_arena.hpp"
+#include "bloom_filter.hpp"
 #include "backing_store.hpp"
 
 #include "logger.hpp"
@@ -95,12 +129,12 @@ public:
   }
 
   void _serialize(std::iostream &fs, serialization_context &context) const {
-    fs << timestamp << " ";
+    serialize(fs, context, timestamp);
     serialize(fs, context, key);
   } 
 
   void _deserialize(std::iostream &fs, serialization_context &context) {
-    fs >> timestamp;
+    deserialize(fs, context, timestamp);
     deserialize(fs, context, key);
   }
 
@@ -131,13 +165,18 @@ bool operator==(const MessageKey<Key> &a, const MessageKey<Key> &b) {
   
 
 // The three types of upsert.  An UPDATE specifies a value, v, that
-// will be added (using operator+) to the old value associated to some
-// key in the tree.  If there is no old value associated with the key,
-// then it will add v to the result of a Value obtained using the
-// default zero-argument constructor.
+// the tree's merge operator will fold into the old value associated
+// to some key in the tree (with add_merge_operator, the default, by
+// operator+).  If there is no old value associated with the key, then
+// it will fold v into a Value obtained using the default
+// zero-argument constructor.
 #define INSERT (0)
 #define DELETE (1)
 #define UPDATE (2)
+// Deletes every key in [lo, hi).  Range deletes are not Messages:
+// nodes buffer them as tombstones beside their messages (see
+// node::ranges).  The opcode is what the log records them under.
+#define DELETE_RANGE (3)
 
 template<class Value>
 class Message {
@@ -153,12 +192,15 @@ public:
   {}
   
   void _serialize(std::iostream &fs, serialization_context &context) {
-    fs << opcode << " ";
+    uint8_t opc = opcode;
+    serialize(fs, context, opc);
     serialize(fs, context, val);
   } 
 
   void _deserialize(std::iostream &fs, serialization_context &context) {
-    fs >> opcode;
+    uint8_t opc;
+    deserialize(fs, context, opc);
+    opcode = opc;
     deserialize(fs, context, val);
   }
 
@@ -171,6 +213,70 @@ bool operator==(const Message<Value> &a, const Message<Value> &b) {
   return a.opcode == b.opcode && a.val == b.val;
 }
 
+// Merge operators say what an UPDATE does.  full_merge folds an
+// update's delta into a value; partial_merge folds a newer delta into
+// an older one, so that a node can buffer consecutive updates to a key
+// as a single delta.  Applying a and then b must come to the same as
+// applying partial_merge(a, b).  Both work in place, so that deltas
+// that grow, like appended strings, are not copied each time.
+template<class Value>
+class add_merge_operator {
+public:
+  static void full_merge(Value &value, const Value &delta) {
+    value = std::move(value) + delta;
+  }
+  static void partial_merge(Value &delta, const Value &newer) {
+    delta = std::move(delta) + newer;
+  }
+};
+
+// Node layouts.  A layout supplies the map type that nodes use for
+// their pivots and their message buffers.  "contiguous" layouts pay
+// for every insertion in the middle of the map with a shift, so
+// nodes apply batches of messages to them with a single merge
+// instead of one insertion per message.  entry_overhead is the
+// approximate memory a map spends on each entry besides the entry
+// itself.  Each node also holds an arena of the layout's arena type,
+// and make_map builds the node's maps on top of it.
+struct no_arena {};
+
+class map_node_layout {
+public:
+  template<class K, class V>
+  using map_type = std::map<K, V>;
+  typedef no_arena arena;
+  template<class Map>
+  static Map make_map(arena &) { return Map(); }
+  static const bool contiguous = false;
+  static const size_t entry_overhead = 48;  // Tree node links and allocator header
+};
+
+class flat_node_layout {
+public:
+  template<class K, class V>
+  using map_type = flat_map<K, V>;
+  typedef no_arena arena;
+  template<class Map>
+  static Map make_map(arena &) { return Map(); }
+  static const bool contiguous = true;
+  static const size_t entry_overhead = 0;
+};
+
+// std::maps whose entries are carved from a per-node arena (see
+// node_arena.hpp), so inserting a message does not call malloc and
+// evicting a node frees its entries a few chunks at a time.  Values
+// that own heap memory (strings) still allocate it themselves.
+class pooled_node_layout {
+public:
+  template<class K, class V>
+  using map_type = std::map<K, V, std::less<K>, arena_allocator<std::pair<const K, V> > >;
+  typedef node_arena arena;
+  template<class Map>
+  static Map make_map(arena &a) { return Map(typename Map::allocator_type(&a)); }
+  static const bool contiguous = false;
+  static const size_t entry_overhead = 32;  // Tree node links
+};
+
 // Measured in messages.
 #define DEFAULT_MAX_NODE_SIZE (1ULL<<18)
 
@@ -179,8 +285,20 @@ bool operator==(const Message<Value> &a, const Message<Value> &b) {
 // Note: we will flush MIN_FLUSH_SIZE/2 items to a clean in-memory child.
 #define DEFAULT_MIN_FLUSH_SIZE (DEFAULT_MAX_NODE_SIZE / 16ULL)
 
+// Checkpoints are written out a few nodes at a time, after each
+// operation, instead of all at once.  0 makes them synchronous.
+#define DEFAULT_CHECKPOINT_WRITES_PER_OPERATION (4)
+
+// With background flushing, upserts wait while the root holds this
+// many times the maximum node size.
+#define DEFAULT_FLUSH_HIGH_WATERMARK (4)
+
+// Bloom filters are sized for at least this many keys.
+#define MIN_BLOOM_FILTER_CAPACITY (64)
 
-template<class Key, class Value> 
+
+template<class Key, class Value, class NodeLayout = map_node_layout,
+         class MergeOperator = add_merge_operator<Value> >
 class betree {
 private:
 
@@ -201,28 +319,80 @@ private:
 
     void _serialize(std::iostream &fs, serialization_context &context) { // Helper function to write into files
       serialize(fs, context, child);
-      fs << " ";
+      serialize_text(fs, context, " ");
       serialize(fs, context, child_size);
+      serialize_text(fs, context, " ");
+      serialize_filter(fs, context, key_filter);
     }
 
     void _deserialize(std::iostream &fs, serialization_context &context) { // Convert back from files
       deserialize(fs, context, child);
       deserialize(fs, context, child_size);
+      deserialize_filter(fs, context, key_filter);
+    }
+
+    uint64_t footprint(void) const {
+      return sizeof(*this);
     }
     
     node_pointer child;
     uint64_t child_size;
+    // The child's own filter, if the child is a leaf that has one.
+    // Checking it here lets a query for an absent key skip reading
+    // the leaf.  Whoever flushes to the child refreshes it.
+    std::shared_ptr<bloom_filter> key_filter;
   };
-  typedef typename std::map<Key, child_info> pivot_map; // Map keys to child pointers
-  typedef typename std::map<MessageKey<Key>, Message<Value> > message_map; // Map (key, timestamp) paris to "Message" (insert, delete, or update)
+
+  static void serialize_filter(std::iostream &fs, serialization_context &context,
+                               std::shared_ptr<bloom_filter> &filter) {
+    serialize(fs, context, (uint8_t)(filter ? 1 : 0));
+    if (filter) {
+      serialize_text(fs, context, " ");
+      serialize(fs, context, *filter);
+    }
+  }
+
+  static void deserialize_filter(std::iostream &fs, serialization_context &context,
+                                 std::shared_ptr<bloom_filter> &filter) {
+    uint8_t present;
+    deserialize(fs, context, present);
+    if (present) {
+      filter = std::make_shared<bloom_filter>();
+      deserialize(fs, context, *filter);
+    } else {
+      filter.reset();
+    }
+  }
+  typedef typename NodeLayout::template map_type<Key, child_info> pivot_map; // Map keys to child pointers
+  typedef typename NodeLayout::template map_type<MessageKey<Key>, Message<Value> > message_map; // Map (key, timestamp) paris to "Message" (insert, delete, or update)
+  typedef typename NodeLayout::template map_type<MessageKey<Key>, Key> range_map; // Map (lo, timestamp) of a range delete to hi
     
   class node : public serializable {
 
   public:
 
+    node(void)
+      : pivots(NodeLayout::template make_map<pivot_map>(arena)),
+	elements(NodeLayout::template make_map<message_map>(arena)),
+	ranges(NodeLayout::template make_map<range_map>(arena))
+    {}
+
+    // Where pivots and elements keep their entries, if the layout
+    // says so.  Declared first so that it outlives them.
+    typename NodeLayout::arena arena;
+
     // Child pointers
     pivot_map pivots;
     message_map elements;
+    // Range deletes waiting to go down to our children.  Each one lies
+    // within the key range of a single child, and is older than every
+    // message in elements for the keys it covers: a range delete that
+    // arrives takes those messages out.  Leaves apply range deletes
+    // and never hold them.
+    range_map ranges;
+    // Every key in elements, and possibly others.  Null when the tree
+    // does not use filters.
+    std::shared_ptr<bloom_filter> filter;
 
     bool is_leaf(void) const {
       return pivots.empty();
@@ -236,13 +406,14 @@ private:
     //         http://stackoverflow.com/a/858893
 
     // get_pivot: Find the appropriate child for a key by locating the closest pivot
+    // Returns end() if the key is smaller than every pivot, i.e. it
+    // cannot be anywhere below this node.
     template<class OUT, class IN>
     static OUT get_pivot(IN & mp, const Key & k) {
       assert(mp.size() > 0);
       auto it = mp.lower_bound(k);
       if (it == mp.begin() && k < it->first)
-	      throw std::out_of_range("Key does not exist "
-				"(it is smaller than any key in DB)");
+	      return mp.end();
       if (it == mp.end() || k < it->first)
 	      --it;
         return it;
@@ -284,22 +455,72 @@ private:
       return it == pivots.end() ? elements.end() : get_element_begin(it->first);
     }
 
+    // Return iterator pointing to the first range delete that goes to
+    // the child indicated by it
+    typename range_map::iterator
+    get_range_begin(const typename pivot_map::iterator it) {
+      return it == pivots.end() ? ranges.end() : ranges.lower_bound(MessageKey<Key>::range_start(it->first));
+    }
+
+    // Take out the range deletes for the child indicated by it.
+    range_map take_ranges(const typename pivot_map::iterator it) {
+      auto first = get_range_begin(it);
+      auto last = get_range_begin(std::next(it));
+      range_map taken(first, last);
+      ranges.erase(first, last);
+      return taken;
+    }
+
+    // Apply range deletes to ourself.  Everything we hold for the keys
+    // they cover is older than they are, so it goes.  An internal node
+    // then keeps each range delete, cut at our pivots, for its
+    // children.
+    void apply_ranges(const range_map &rngs) {
+      for (auto it = rngs.begin(); it != rngs.end(); ++it) {
+        const Key &lo = it->first.key;
+        const Key &hi = it->second;
+        elements.erase(get_element_begin(lo), get_element_begin(hi));
+        if (is_leaf())
+          continue;
+        for (auto child = get_pivot(lo); child != pivots.end() && child->first < hi; ++child) {
+          auto next = std::next(child);
+          const Key &start = child->first < lo ? lo : child->first;
+          const Key &end = next != pivots.end() && next->first < hi ? next->first : hi;
+          ranges[MessageKey<Key>(start, it->first.timestamp)] = end;
+        }
+      }
+    }
+
     // Apply a message to ourself.
     // Apply a Message to the node base on the MessageKey
     void apply(const MessageKey<Key> &mkey, const Message<Value> &elt,
 	       Value &default_value) {
       switch (elt.opcode) {
       case INSERT:
-	        elements.erase(elements.lower_bound(mkey.range_start()),
-		      elements.upper_bound(mkey.range_end()));
-          elements[mkey] = elt;
+          {
+            auto lo = elements.lower_bound(mkey.range_start());
+            auto hi = elements.upper_bound(mkey.range_end());
+            if constexpr (NodeLayout::contiguous) {
+              // Overwriting the key's only message in place saves
+              // shifting the tail of the arrays twice.
+              if (lo != hi && std::next(lo) == hi) {
+                elements.replace(lo, mkey, elt);
+                break;
+              }
+            }
+            elements.erase(lo, hi);
+            elements[mkey] = elt;
+            note_key(mkey.key);
+          }
           break;
 
       case DELETE:
 	        elements.erase(elements.lower_bound(mkey.range_start()),
 		      elements.upper_bound(mkey.range_end()));
-          if (!is_leaf())
+          if (!is_leaf()) {
             elements[mkey] = elt;
+            note_key(mkey.key);
+          }
           break;
 
       case UPDATE:
@@ -310,18 +531,25 @@ private:
             if (iter == elements.end() || iter->first.key != mkey.key)
               if (is_leaf()) {
                 Value dummy = default_value;
-                apply(mkey, Message<Value>(INSERT, dummy + elt.val),
-                default_value);
+                MergeOperator::full_merge(dummy, elt.val);
+                apply(mkey, Message<Value>(INSERT, dummy), default_value);
               } else {
                 elements[mkey] = elt;
+                note_key(mkey.key);
               }
             else {
               assert(iter != elements.end() && iter->first.key == mkey.key);
+              // Merge into our newest message for the key, in place.
+              // It keeps its timestamp, which is still newer than
+              // anything below us and older than anything above.
               if (iter->second.opcode == INSERT) {
-                apply(mkey, Message<Value>(INSERT, iter->second.val + elt.val),
-                default_value);	  
+                MergeOperator::full_merge(iter->second.val, elt.val);
+              } else if (iter->second.opcode == UPDATE) {
+                MergeOperator::partial_merge(iter->second.val, elt.val);
               } else {
-                elements[mkey] = elt;	      
+                Value dummy = default_value;
+                MergeOperator::full_merge(dummy, elt.val);
+                apply(mkey, Message<Value>(INSERT, dummy), default_value);
               }
             }
           }
@@ -331,11 +559,99 @@ private:
 	    assert(0);
       }
     }
+
+    // Apply the same rules as above to the messages for a single key,
+    // held in timestamp order in msgs.
+    static void apply(std::vector<std::pair<MessageKey<Key>, Message<Value> > > &msgs,
+		      bool leaf,
+		      const MessageKey<Key> &mkey, const Message<Value> &elt,
+		      const Value &default_value) {
+      switch (elt.opcode) {
+      case INSERT:
+	msgs.clear();
+	msgs.emplace_back(mkey, elt);
+	break;
+
+      case DELETE:
+	msgs.clear();
+	if (!leaf)
+	  msgs.emplace_back(mkey, elt);
+	break;
+
+      case UPDATE:
+	if (msgs.empty() && !leaf) {
+	  msgs.emplace_back(mkey, elt);
+	} else if (msgs.empty() || msgs.back().second.opcode == DELETE) {
+	  msgs.clear();
+	  msgs.emplace_back(mkey, Message<Value>(INSERT, default_value));
+	  MergeOperator::full_merge(msgs.back().second.val, elt.val);
+	} else if (msgs.back().second.opcode == INSERT) {
+	  MergeOperator::full_merge(msgs.back().second.val, elt.val);
+	} else {
+	  MergeOperator::partial_merge(msgs.back().second.val, elt.val);
+	}
+	break;
+
+      default:
+	assert(0);
+      }
+    }
+
+    // Apply a batch of messages to ourself.  With a contiguous
+    // layout, every insertion shifts the tail of our arrays, so
+    // instead we merge the batch with our buffer in one pass,
+    // rebuilding it in key order.  Incoming messages are always newer
+    // than the ones we already hold for the same key.
+    void apply(const message_map &elts, Value &default_value) {
+      if constexpr (!NodeLayout::contiguous) {
+	for (auto it = elts.begin(); it != elts.end(); ++it)
+	  apply(it->first, it->second, default_value);
+      } else {
+	if (elts.size() == 1) {
+	  apply(elts.begin()->first, elts.begin()->second, default_value);
+	  return;
+	}
+
+	message_map merged;
+	merged.reserve(elements.size() + elts.size());
+	std::vector<std::pair<MessageKey<Key>, Message<Value> > > msgs;
+	auto old_it = elements.begin();
+	auto new_it = elts.begin();
+	bool leaf = is_leaf();
+	while (old_it != elements.end() || new_it != elts.end()) {
+	  if (new_it == elts.end() ||
+	      (old_it != elements.end() && old_it->first.key < new_it->first.key)) {
+	    merged.emplace_hint(merged.end(), old_it->first, std::move(old_it->second));
+	    ++old_it;
+	    continue;
+	  }
+
+	  const Key &k = new_it->first.key;
+	  msgs.clear();
+	  while (old_it != elements.end() && old_it->first.key == k) {
+	    msgs.emplace_back(old_it->first, std::move(old_it->second));
+	    ++old_it;
+	  }
+	  auto key_end = new_it;
+	  while (key_end != elts.end() && key_end->first.key == k)
+	    ++key_end;
+	  for (; new_it != key_end; ++new_it)
+	    apply(msgs, leaf, new_it->first, new_it->second, default_value);
+	  for (auto &msg : msgs)
+	    merged.emplace_hint(merged.end(), msg.first, std::move(msg.second));
+	  if (!msgs.empty())
+	    note_key(k);
+	}
+	elements.swap(merged);
+      }
+    }
     
     // Requires: there are less than MIN_FLUSH_SIZE things in elements
     //           destined for each child in pivots);
     pivot_map split(betree &bet) {
       assert(pivots.size() + elements.size() >= bet.max_node_size);
+      if (!is_leaf())
+        bet.internal_nodes_changed = true;
       // This size split does a good job of causing the resulting
       // nodes to have size between 0.4 * MAX_NODE_SIZE and 0.6 * MAX_NODE_SIZE.
       int num_new_leaves = (pivots.size() + elements.size())  / (10 * bet.max_node_size / 24);
@@ -344,6 +660,7 @@ private:
       pivot_map result;
       auto pivot_idx = pivots.begin();
       auto elt_idx = elements.begin();
+      auto range_idx = ranges.begin();
       int things_moved = 0;
       for (int i = 0; i < num_new_leaves; i++) {
         if (pivot_idx == pivots.end() && elt_idx == elements.end())
@@ -365,6 +682,11 @@ private:
               ++elt_idx;
               things_moved++;
             }
+            auto range_end = get_range_begin(pivot_idx);
+            while (range_idx != range_end) {
+              new_node->ranges[range_idx->first] = range_idx->second;
+              ++range_idx;
+            }
           } else {
             // Must be a leaf
             assert(pivots.size() == 0);
@@ -375,14 +697,19 @@ private:
         }
       }
       
-      for (auto it = result.begin(); it != result.end(); ++it)
+      for (auto it = result.begin(); it != result.end(); ++it) {
 	    it->second.child_size = it->second.child->elements.size() +
 	    it->second.child->pivots.size();
+	    it->second.child->maintain_filter(bet);
+	    it->second.key_filter = it->second.child->filter_for_parent();
+      }
       
       assert(pivot_idx == pivots.end());
       assert(elt_idx == elements.end());
+      assert(range_idx == ranges.end());
       pivots.clear();
       elements.clear();
+      ranges.clear();
       return result;
     }
 
@@ -422,23 +749,50 @@ private:
       }
     }
     
-    // Receive a collection of new messages and perform recursive
-    // flushes or splits as necessary.  If we split, return a
-    // map with the new pivot keys pointing to the new nodes.
-    // Otherwise return an empty map.
-    pivot_map flush(betree &bet, message_map &elts)
+    // Start loading the children that the flush loop below is going
+    // to pick: those with the most buffered messages, until enough
+    // messages are covered to bring this node back under
+    // max_node_size.  Children that are in memory cost nothing.
+    void prefetch_flush_targets(const betree &bet) {
+      std::vector<std::pair<uint64_t, const node_pointer *> > candidates;
+      for (auto it = pivots.begin(); it != pivots.end(); ++it) {
+        uint64_t dist = std::distance(get_element_begin(it), get_element_begin(std::next(it)));
+        if (dist > bet.min_flush_size)
+          candidates.push_back(std::make_pair(dist, &it->second.child));
+      }
+      std::sort(candidates.begin(), candidates.end(),
+                [](const std::pair<uint64_t, const node_pointer *> &a,
+                   const std::pair<uint64_t, const node_pointer *> &b) { return a.first > b.first; });
+
+      uint64_t excess = elements.size() + pivots.size() - bet.max_node_size + 1;
+      for (auto &c : candidates) {
+        c.second->prefetch();
+        if (c.first >= excess)
+          break;
+        excess -= c.first;
+      }
+    }
+
+    // Receive a collection of new messages and range deletes, and
+    // perform recursive flushes or splits as necessary.  The range
+    // deletes are older than any message in elts that they cover.  If
+    // we split, return a map with the new pivot keys pointing to the
+    // new nodes.  Otherwise return an empty map.
+    pivot_map flush(betree &bet, message_map &elts, range_map &rngs)
     {
       debug(std::cout << "Flushing " << this << std::endl);
       pivot_map result;
 
-      if (elts.size() == 0) {
+      if (elts.size() == 0 && rngs.size() == 0) {
 	debug(std::cout << "Done (empty input)" << std::endl);
 	return result;
       }
 
       if (is_leaf()) {
-        for (auto it = elts.begin(); it != elts.end(); ++it)
-          apply(it->first, it->second, bet.default_value);
+        apply_ranges(rngs);
+        if (elts.size() > 0)
+          apply(elts, bet.default_value);
+        maintain_filter(bet);
         if (elements.size() + pivots.size() >= bet.max_node_size)
           result = split(bet);
         return result;
@@ -446,28 +800,33 @@ private:
 
       ////////////// Non-leaf
       
-      // Update the key of the first child, if necessary
-      Key oldmin = pivots.begin()->first;
-      MessageKey<Key> newmin = elts.begin()->first;
-      if (newmin < oldmin) {
-        pivots[newmin.key] = pivots[oldmin];
-        pivots.erase(oldmin);
-      }
+      if (elts.size() > 0)
+        cover_first_key(elts.begin()->first);
+      if (rngs.size() > 0)
+        cover_first_key(rngs.begin()->first);
 
       // If everything is going to a single dirty child, go ahead
-      // and put it there.
-      auto first_pivot_idx = get_pivot(elts.begin()->first.key);
-      auto last_pivot_idx = get_pivot((--elts.end())->first.key);
-      if (first_pivot_idx == last_pivot_idx &&first_pivot_idx->second.child.is_dirty()) {
-              // There shouldn't be anything in our buffer for this child,
-              // but lets assert that just to be safe.
+      // and put it there.  Range deletes may span children, so they
+      // take the long way.
+      auto first_pivot_idx = elts.size() > 0 ? get_pivot(elts.begin()->first.key) : pivots.end();
+      auto last_pivot_idx = elts.size() > 0 ? get_pivot((--elts.end())->first.key) : pivots.end();
+      assert(elts.size() == 0 || first_pivot_idx != pivots.end());
+      if (rngs.size() == 0 && first_pivot_idx == last_pivot_idx &&first_pivot_idx->second.child.is_dirty()) {
+        // Usually there is nothing in our buffer for this child.  But
+        // the cache may evict a node before its children, and a node
+        // reloaded clean buffers messages for a child that is still
+        // dirty.  Those are older than elts, so take them along.
+        range_map child_rngs = take_ranges(first_pivot_idx);
         {
-          auto next_pivot_idx = next(first_pivot_idx);
+          auto next_pivot_idx = std::next(first_pivot_idx);
           auto elt_start = get_element_begin(first_pivot_idx);
-          auto elt_end = get_element_begin(next_pivot_idx); 
-          assert(elt_start == elt_end);
+          auto elt_end = get_element_begin(next_pivot_idx);
+          if (elt_start != elt_end) {
+            elts.insert(elt_start, elt_end);
+            elements.erase(elt_start, elt_end);
+          }
         }
-              pivot_map new_children = first_pivot_idx->second.child->flush(bet, elts);
+              pivot_map new_children = first_pivot_idx->second.child->flush(bet, elts, child_rngs);
               if (!new_children.empty()) {
                 pivots.erase(first_pivot_idx);
                 pivots.insert(new_children.begin(), new_children.end());
@@ -475,92 +834,162 @@ private:
                   first_pivot_idx->second.child_size =
                   first_pivot_idx->second.child->pivots.size() +
                   first_pivot_idx->second.child->elements.size();
+                  first_pivot_idx->second.key_filter =
+                  first_pivot_idx->second.child->filter_for_parent();
                 }
 
       } else {
           
-          for (auto it = elts.begin(); it != elts.end(); ++it)
-            apply(it->first, it->second, bet.default_value);
-
-          // Now flush to out-of-core or clean children as necessary
-          while (elements.size() + pivots.size() >= bet.max_node_size) {
-            // Find the child with the largest set of messages in our buffer
-            unsigned int max_size = 0;
-            auto child_pivot = pivots.begin();
-            auto next_pivot = pivots.begin();
-            for (auto it = pivots.begin(); it != pivots.end(); ++it) {
-              auto it2 = next(it);
-              auto elt_it = get_element_begin(it); 
-              auto elt_it2 = get_element_begin(it2); 
-              unsigned int dist = distance(elt_it, elt_it2);
-              if (dist > max_size) {
-                child_pivot = it;
-                next_pivot = it2;
-                max_size = dist;
-              }
-            }
-            if (!(max_size > bet.min_flush_size ||
-            (max_size > bet.min_flush_size/2 &&
-            child_pivot->second.child.is_in_memory())))
-              break; // We need to split because we have too many pivots
-            auto elt_child_it = get_element_begin(child_pivot);
-            auto elt_next_it = get_element_begin(next_pivot);
-            message_map child_elts(elt_child_it, elt_next_it);
-            pivot_map new_children = child_pivot->second.child->flush(bet, child_elts);
-            elements.erase(elt_child_it, elt_next_it);
-            if (!new_children.empty()) {
-              pivots.erase(child_pivot);
-              pivots.insert(new_children.begin(), new_children.end());
-            } else {
-              first_pivot_idx->second.child_size =
-                child_pivot->second.child->pivots.size() +
-                child_pivot->second.child->elements.size();
-            }
-          }
-
-          // We have too many pivots to efficiently flush stuff down, so split
-          if (elements.size() + pivots.size() > bet.max_node_size) {
-            result = split(bet);
-          }
+          apply_ranges(rngs);
+          if (elts.size() > 0)
+            apply(elts, bet.default_value);
+          result = flush_buffer(bet, UINT64_MAX);
       }
 
       //merge_small_children(bet);
+
+      maintain_filter(bet);
       
       debug(std::cout << "Done flushing " << this << std::endl);
       return result;
     }
 
-    Value query(const betree & bet, const Key k) const
+    // Flush batches from our buffer to our children until we fit, or
+    // until max_batches of them have gone down, and split if there
+    // is nothing big enough left to flush.  Returns the new nodes if
+    // we split.
+    pivot_map flush_buffer(betree &bet, uint64_t max_batches)
+    {
+      pivot_map result;
+      // Now flush to out-of-core or clean children as necessary
+      if (elements.size() + pivots.size() >= bet.max_node_size)
+        prefetch_flush_targets(bet);
+      for (uint64_t batches = 0; elements.size() + pivots.size() >= bet.max_node_size; batches++) {
+        if (batches == max_batches)
+          return result;  // Still too big, but not split: more next time
+        // Find the child with the largest set of messages in our
+        // buffer.  Its range deletes count too.
+        unsigned int max_size = 0;
+        auto child_pivot = pivots.begin();
+        auto next_pivot = pivots.begin();
+        for (auto it = pivots.begin(); it != pivots.end(); ++it) {
+          auto it2 = std::next(it);
+          auto elt_it = get_element_begin(it); 
+          auto elt_it2 = get_element_begin(it2); 
+          unsigned int dist = std::distance(elt_it, elt_it2);
+          if (ranges.size() > 0)
+            dist += std::distance(get_range_begin(it), get_range_begin(it2));
+          if (dist > max_size) {
+            child_pivot = it;
+            next_pivot = it2;
+            max_size = dist;
+          }
+        }
+        if (!(max_size > bet.min_flush_size ||
+        (max_size > bet.min_flush_size/2 &&
+        child_pivot->second.child.is_in_memory())))
+          break; // We need to split because we have too many pivots
+        auto elt_child_it = get_element_begin(child_pivot);
+        auto elt_next_it = get_element_begin(next_pivot);
+        message_map child_elts(elt_child_it, elt_next_it);
+        range_map child_rngs = take_ranges(child_pivot);
+        pivot_map new_children = child_pivot->second.child->flush(bet, child_elts, child_rngs);
+        elements.erase(elt_child_it, elt_next_it);
+        if (!new_children.empty()) {
+          pivots.erase(child_pivot);
+          pivots.insert(new_children.begin(), new_children.end());
+        } else {
+          child_pivot->second.child_size =
+            child_pivot->second.child->pivots.size() +
+            child_pivot->second.child->elements.size();
+          child_pivot->second.key_filter =
+            child_pivot->second.child->filter_for_parent();
+        }
+      }
+
+      // We have too many pivots to efficiently flush stuff down, so split
+      if (elements.size() + pivots.size() > bet.max_node_size) {
+        result = split(bet);
+      }
+      return result;
+    }
+
+    // Take elts into our buffer without flushing any of it, however
+    // big the buffer gets.  The background flusher calls drain() on
+    // us later.
+    void buffer(betree &bet, message_map &elts, range_map &rngs)
+    {
+      if (!is_leaf() && elts.size() > 0)
+        cover_first_key(elts.begin()->first);
+      if (!is_leaf() && rngs.size() > 0)
+        cover_first_key(rngs.begin()->first);
+      apply_ranges(rngs);
+      if (elts.size() > 0)
+        apply(elts, bet.default_value);
+      maintain_filter(bet);
+    }
+
+    // One step of bringing an oversized node (see buffer()) back
+    // under the maximum size: flush one batch to a child, or split.
+    // Returns the new nodes if we split.
+    pivot_map drain(betree &bet)
+    {
+      if (is_leaf())
+        return split(bet);
+      return flush_buffer(bet, 1);
+    }
+
+    // Our first pivot must not be above any key in our buffer or
+    // subtree, so lower it to newmin if necessary.
+    void cover_first_key(const MessageKey<Key> &newmin)
+    {
+      Key oldmin = pivots.begin()->first;
+      if (newmin < oldmin) {
+        // Copy first: inserting into a contiguous layout would
+        // invalidate a reference to the old entry.
+        child_info first_child = pivots.begin()->second;
+        pivots.erase(oldmin);
+        pivots[newmin.key] = first_child;
+      }
+    }
+
+    // Look up k in this subtree.  Returns false if it does not
+    // exist, in which case v is unspecified.  Negative lookups are
+    // common, so this does not use exceptions.
+    bool query(const betree & bet, const Key k, Value &v) const
     {
       debug(std::cout << "Querying " << this << std::endl);
+      uint64_t h = bloom_hash(k);
       if (is_leaf()) {
+        if (filter && !filter->may_contain(h))
+          return false;
         auto it = elements.lower_bound(MessageKey<Key>::range_start(k));
         if (it != elements.end() && it->first.key == k) {
           assert(it->second.opcode == INSERT);
-          return it->second.val;
+          v = it->second.val;
+          return true;
         } else {
-          throw std::out_of_range("Key does not exist");
+          return false;
         }
       }
 
       ///////////// Non-leaf
       
-      auto message_iter = get_element_begin(k);
-      Value v = bet.default_value;
+      auto message_iter = filter && !filter->may_contain(h) ?
+        elements.end() : get_element_begin(k);
+      v = bet.default_value;
 
-      if (message_iter == elements.end() || k < message_iter->first)
+      if (message_iter == elements.end() || k < message_iter->first) {
 	// If we don't have any messages for this key, just search
 	// further down the tree.
-	    v = get_pivot(k)->second.child->query(bet, k);
-      else if (message_iter->second.opcode == UPDATE) {
+        return query_child(bet, k, h, v);
+      } else if (message_iter->second.opcode == UPDATE) {
         // We have some updates for this key.  Search down the tree.
         // If it has something, then apply our updates to that.  If it
         // doesn't have anything, then apply our updates to the
         // default initial value.
-        try {
-          Value t = get_pivot(k)->second.child->query(bet, k);
-          v = t;
-        } catch (std::out_of_range & e) {}
+        if (!query_child(bet, k, h, v))
+          v = bet.default_value;
       } else if (message_iter->second.opcode == DELETE) {
 	// We have a delete message, so we don't need to look further
 	// down the tree.  If we don't have any further update or
@@ -568,7 +997,7 @@ private:
 	// this subtree).
         message_iter++;
         if (message_iter == elements.end() || k < message_iter->first)
-          throw std::out_of_range("Key does not exist");
+          return false;
       } else if (message_iter->second.opcode == INSERT) {
         // We have an insert message, so we don't need to look further
         // down the tree.  We'll apply any updates to this value.
@@ -579,66 +1008,134 @@ private:
       // Apply any updates to the value obtained above.
       while (message_iter != elements.end() && message_iter->first.key == k) {
         assert(message_iter->second.opcode == UPDATE);
-        v = v + message_iter->second.val;
+        MergeOperator::full_merge(v, message_iter->second.val);
         message_iter++;
       }
 
-      return v;
-    }
-
-    std::pair<MessageKey<Key>, Message<Value> >
-    get_next_message_from_children(const MessageKey<Key> *mkey) const {
-      if (mkey && *mkey < pivots.begin()->first)
-	mkey = NULL;
-      auto it = mkey ? get_pivot(mkey->key) : pivots.begin();
-      while (it != pivots.end()) {
-	try {
-	  return it->second.child->get_next_message(mkey);
-	} catch (std::out_of_range & e) {}
-	++it;
-      }
-      throw std::out_of_range("No more messages in any children");
+      return true;
     }
-    
-    std::pair<MessageKey<Key>, Message<Value> >
-    get_next_message(const MessageKey<Key> *mkey) const {
-      auto it = mkey ? elements.upper_bound(*mkey) : elements.begin();
-
-      if (is_leaf()) {
-	if (it == elements.end())
-	  throw std::out_of_range("No more messages in sub-tree");
-	return std::make_pair(it->first, it->second);
-      }
 
-      if (it == elements.end())
-	return get_next_message_from_children(mkey);
-      
-      try {
-	auto kids = get_next_message_from_children(mkey);
-	if (kids.first < it->first)
-	  return kids;
-	else 
-	  return std::make_pair(it->first, it->second);
-      } catch (std::out_of_range & e) {
-	return std::make_pair(it->first, it->second);	
-      }
-    }
-    
     void _serialize(std::iostream &fs, serialization_context &context) {
-      fs << "pivots:" << std::endl;
+      serialize_text(fs, context, "pivots:\n");
       serialize(fs, context, pivots);
-      fs << "elements:" << std::endl;
+      serialize_text(fs, context, "elements:\n");
       serialize(fs, context, elements);
+      serialize_text(fs, context, "ranges:\n");
+      serialize(fs, context, ranges);
+      serialize_text(fs, context, "filter: ");
+      serialize_filter(fs, context, filter);
+      serialize_text(fs, context, "\n");
     }
     
     void _deserialize(std::iostream &fs, serialization_context &context) {
-      std::string dummy;
-      fs >> dummy;
+      deserialize_text(fs, context, "pivots:");
       deserialize(fs, context, pivots);
-      fs >> dummy;
+      deserialize_text(fs, context, "elements:");
       deserialize(fs, context, elements);
+      deserialize_text(fs, context, "ranges:");
+      deserialize(fs, context, ranges);
+      deserialize_text(fs, context, "filter:");
+      deserialize_filter(fs, context, filter);
+      measure_values();
+    }
+
+    // Entries are charged their size plus the layout's overhead.  The
+    // heap memory of buffered values is estimated from their average
+    // size, which is measured again whenever the buffer has doubled
+    // since the last measurement, so this stays amortized O(1).
+    // Filters are charged too; the children's filters are measured
+    // again whenever the number of children changes.
+    uint64_t footprint(void) const {
+      if (elements.size() > 2 * measured_elements)
+        measure_values();
+      if (pivots.size() != measured_pivots)
+        measure_child_filters();
+      return sizeof(*this) +
+        pivots.size() * (sizeof(Key) + sizeof(child_info) + NodeLayout::entry_overhead) +
+        elements.size() * (sizeof(MessageKey<Key>) + sizeof(Message<Value>) +
+                           NodeLayout::entry_overhead + average_value_bytes) +
+        ranges.size() * (sizeof(MessageKey<Key>) + sizeof(Key) + NodeLayout::entry_overhead) +
+        (filter ? filter->footprint() : 0) + child_filter_bytes;
     }
 
+    // Whether one of our range deletes covers k, which is under
+    // child.  Only those of child's range deletes that start at or
+    // before k can.
+    bool range_deleted(typename pivot_map::const_iterator child, const Key &k) const {
+      if (ranges.empty())
+        return false;
+      auto last = ranges.upper_bound(MessageKey<Key>::range_end(k));
+      for (auto it = ranges.lower_bound(MessageKey<Key>::range_start(child->first)); it != last; ++it)
+        if (k < it->second)
+          return true;
+      return false;
+    }
+
+  private:
+    // Add k to our filter, if we have one.
+    void note_key(const Key &k) {
+      if (filter)
+        filter->add(bloom_hash(k));
+    }
+
+    // Create, rebuild or drop our filter, as the tree's settings and
+    // the filter's fill require.  A rebuild happens in place, so a
+    // parent that shares the filter sees it too.
+    void maintain_filter(const betree &bet) {
+      if (bet.bloom_bits_per_key == 0) {
+        filter.reset();
+        return;
+      }
+      if (filter && !filter->full())
+        return;
+      if (!filter)
+        filter = std::make_shared<bloom_filter>();
+      filter->reset(std::max<uint64_t>(2 * elements.size(), MIN_BLOOM_FILTER_CAPACITY),
+                    bet.bloom_bits_per_key);
+      for (auto it = elements.begin(); it != elements.end(); ++it)
+        filter->add(bloom_hash(it->first.key));
+    }
+
+    // What our parent keeps in our child_info.  Only a leaf's filter
+    // covers its whole subtree.
+    std::shared_ptr<bloom_filter> filter_for_parent(void) const {
+      return is_leaf() ? filter : nullptr;
+    }
+
+    // Look k up in the child responsible for it, unless that child's
+    // filter rules it out.
+    bool query_child(const betree &bet, const Key &k, uint64_t h, Value &v) const {
+      auto child = get_pivot(k);
+      if (child == pivots.end())
+        return false;
+      if (range_deleted(child, k))
+        return false;
+      if (child->second.key_filter && !child->second.key_filter->may_contain(h))
+        return false;
+      return child->second.child->query(bet, k, v);
+    }
+
+    void measure_values(void) const {
+      uint64_t total = 0;
+      for (auto it = elements.begin(); it != elements.end(); ++it)
+        total += heap_footprint(it->second.val);
+      measured_elements = elements.size();
+      average_value_bytes = measured_elements ? total / measured_elements : 0;
+    }
+
+    void measure_child_filters(void) const {
+      child_filter_bytes = 0;
+      for (auto it = pivots.begin(); it != pivots.end(); ++it)
+        if (it->second.key_filter)
+          child_filter_bytes += it->second.key_filter->footprint();
+      measured_pivots = pivots.size();
+    }
+
+    mutable uint64_t measured_elements = 0;
+    mutable uint64_t average_value_bytes = 0;
+    mutable uint64_t measured_pivots = 0;
+    mutable uint64_t child_filter_bytes = 0;
+
     
   };
 
@@ -649,7 +1146,24 @@ private:
   uint64_t min_node_size;
   node_pointer root;
   uint64_t next_timestamp = 1; // Nothing has a timestamp of 0
+  uint64_t checkpoint_writes_per_operation = DEFAULT_CHECKPOINT_WRITES_PER_OPERATION;
+  uint64_t bloom_bits_per_key = 0;
+  uint64_t resident_levels = 0;
+  uint64_t resident_bytes = 0;
+  uint64_t height = 0;  // In levels; 0 until someone needs it
+  bool internal_nodes_changed = false;
   Value default_value;
+  // Shared by readers, held exclusively by the writer.
+  mutable rwlock tree_mutex;
+
+  // Background flushing (see set_background_flushing()).  Protected
+  // by tree_mutex.
+  std::thread flusher;
+  bool background_flushing = false;
+  bool flusher_stopping = false;
+  uint64_t flush_high_watermark;  // In messages and pivots at the root
+  std::condition_variable_any root_full;     // Signals the flusher
+  std::condition_variable_any root_drained;  // Signals throttled upserts
   
 public:
   betree(swap_space *sspace,
@@ -661,25 +1175,131 @@ public:
     logger(logger_ptr),
     min_flush_size(minflushsize),
     max_node_size(maxnodesize),
-    min_node_size(minnodesize)
+    min_node_size(minnodesize),
+    flush_high_watermark(DEFAULT_FLUSH_HIGH_WATERMARK * maxnodesize)
     
   {
-    root = ss->allocate(new node);
-    Recovery recovery(sspace, this);
-    recovery.do_recovery();
+    // Replayed operations are already in the log, so they are applied
+    // without logging them again.  They keep their original LSN as
+    // their timestamp.
+    Recovery recovery(sspace, [this](uint64_t lsn, int opcode, uint64_t k, const std::string &v) {
+      if (opcode == DELETE_RANGE)
+        apply_delete_range(k, decode_key(v), lsn);
+      else
+        apply_upsert(opcode, k, v, lsn);
+    });
+    if (recovery.restore_checkpoint())
+      root = ss->get_root<node>();
+    else
+      root = ss->allocate(new node);
+    ss->set_root(root);
+    recovery.replay_log();
+    if (logger)
+      logger->resume(recovery.get_last_lsn(), recovery.get_checkpoint_lsn());
   }
 
-  void do_checkpoint() {
-    
-    ss->checkpoint(); // flush dirty obj
+  ~betree(void)
+  {
+    stop_flusher();
+  }
 
-    uint64_t current_lsn = logger->get_current_lsn();
+  void set_checkpoint_writes_per_operation(uint64_t n)
+  {
+    checkpoint_writes_per_operation = n;
+  }
 
-    logger->checkpoint(current_lsn);
+  // With background flushing on, upserts only add their messages to
+  // the root's buffer, and a background thread pushes them down the
+  // tree, a batch at a time, with the same logic as a synchronous
+  // flush.  An upsert then never pays for a cascade of flushes and
+  // splits, but the root may grow past the maximum node size.  Once
+  // it holds the high watermark (see set_flush_high_watermark()),
+  // upserts wait for the flusher to catch up.  Turning it off brings
+  // the root back under the maximum size before returning.
+  void set_background_flushing(bool on)
+  {
+    if (on && !flusher.joinable()) {
+      std::unique_lock<rwlock> lock(tree_mutex);
+      background_flushing = true;
+      flusher_stopping = false;
+      flusher = std::thread(&betree::flusher_loop, this);
+    } else if (!on && flusher.joinable()) {
+      stop_flusher();
+      std::unique_lock<rwlock> lock(tree_mutex);
+      while (root_needs_flush()) {
+        pivot_map new_nodes = root->drain(*this);
+        grow_root(new_nodes);
+      }
+    }
+  }
 
-    ss->update_master_record(current_lsn);
-  
-    ss->deallocate_old_versions();
+  // In messages and pivots at the root.  More than the maximum node
+  // size: the flusher only takes on a root that is over it, so
+  // upserts waiting on a root at exactly the maximum would wait for
+  // good.
+  void set_flush_high_watermark(uint64_t n)
+  {
+    std::unique_lock<rwlock> lock(tree_mutex);
+    flush_high_watermark = std::max(n, max_node_size + 1);
+    root_drained.notify_all();
+  }
+
+  // Keep internal nodes in memory for good, so that once the tree is
+  // warm a point query reads at most a leaf.  set_resident_levels(k)
+  // keeps the internal nodes of the top k levels.  Below them,
+  // set_resident_bytes(b) keeps further internal nodes, level by
+  // level, for as long as their footprints fit in b bytes.  Leaves
+  // stay evictable.  The swap space caps the resident nodes at half
+  // of the cache, so a small cache keeps fewer of them.  The resident
+  // set is chosen again whenever an internal node splits, and node
+  // footprints may drift past b in between.
+  void set_resident_levels(uint64_t levels)
+  {
+    std::unique_lock<rwlock> lock(tree_mutex);
+    resident_levels = levels;
+    refresh_residency();
+  }
+
+  void set_resident_bytes(uint64_t bytes)
+  {
+    std::unique_lock<rwlock> lock(tree_mutex);
+    resident_bytes = bytes;
+    refresh_residency();
+  }
+
+  // Keep a Bloom filter of this many bits per key over each node's
+  // buffered keys (a leaf's keys are all in its buffer), so point
+  // queries can skip buffers, and leaves, that do not hold the key.
+  // Nodes pick the setting up the next time they are modified.  0,
+  // the default, turns filters off.
+  void set_bloom_bits_per_key(uint64_t bits)
+  {
+    std::unique_lock<rwlock> lock(tree_mutex);
+    bloom_bits_per_key = bits;
+  }
+
+  // Whether an incremental checkpoint is under way.
+  bool checkpoint_in_progress(void) {
+    std::shared_lock<rwlock> lock(tree_mutex);
+    return ss->checkpoint_in_progress();
+  }
+
+  // Take a checkpoint of everything logged so far and wait for it.
+  void do_checkpoint() {
+    std::unique_lock<rwlock> lock(tree_mutex);
+    checkpoint_now();
+  }
+
+  class snapshot;
+
+  // Take a checkpoint, as do_checkpoint() does, and return a read-only
+  // view of the tree as of that checkpoint.
+  snapshot take_snapshot(void) {
+    std::unique_lock<rwlock> lock(tree_mutex);
+    checkpoint_now();
+    std::shared_ptr<swap_snapshot> view = ss->take_snapshot();
+    assert(view);
+    return snapshot(*this, view);
   }
 
   // Insert the specified message and handle a split of the root if it
@@ -693,27 +1313,284 @@ public:
     // do recovery here, might need to check log file is emtpy or not, might also need root info
     // std::cout << "upsert " << opcode << " " << k << " " << "v" << v <<std::endl;
 
+    std::unique_lock<rwlock> lock(tree_mutex);
+    wait_for_flusher(lock);
+    uint64_t timestamp = 0;
     if (logger){
-      logger->log_operation(opcode, k, v);
+      timestamp = logger->log_operation(opcode, k, v);
     } else {
       std::cerr << "Logger has not been initialized" << std::endl;
     }
 
+    apply_upsert(opcode, k, v, timestamp);
+
+    maybe_checkpoint();
+  }
+
+  typedef std::tuple<int, Key, Value> operation;
+  typedef MergeOperator merge_operator;
+
+  // Apply a range of operations (tuples of opcode, key, value) with
+  // the same result as upserting them one at a time, in order.  The
+  // batch is logged as one group and all of its messages travel down
+  // from the root together, so each node on the way is pinned once
+  // per batch rather than once per message.
+  template<class ForwardIterator>
+  void upsert_batch(ForwardIterator first, ForwardIterator last)
+  {
+    if (first == last)
+      return;
+
+    std::unique_lock<rwlock> lock(tree_mutex);
+    wait_for_flusher(lock);
+    uint64_t timestamp = 0;
+    if (logger){
+      timestamp = logger->log_batch(first, last);
+    } else {
+      std::cerr << "Logger has not been initialized" << std::endl;
+      timestamp = next_timestamp;
+    }
+
+    std::vector<std::pair<MessageKey<Key>, Message<Value> > > msgs;
+    for (; first != last; ++first)
+      msgs.push_back(std::make_pair(MessageKey<Key>(std::get<1>(*first), timestamp++),
+                                    Message<Value>(std::get<0>(*first), std::get<2>(*first))));
+    if (timestamp > next_timestamp)
+      next_timestamp = timestamp;
+
+    std::sort(msgs.begin(), msgs.end(),
+              [](const std::pair<MessageKey<Key>, Message<Value> > &a,
+                 const std::pair<MessageKey<Key>, Message<Value> > &b) {
+                return a.first < b.first;
+              });
+    message_map tmp(msgs.begin(), msgs.end());
+    range_map no_ranges;
+    flush_root(tmp, no_ranges);
+
+    maybe_checkpoint();
+  }
+
+private:
+  // Called after every operation.  Starts a checkpoint when one is
+  // due and moves the running one along.
+  void maybe_checkpoint()
+  {
+    if (!logger)
+      return;
+    if (!ss->checkpoint_in_progress()) {
+      if (!logger->need_checkpoint())
+        return;
+      std::cout << "Performing Checkpointing..." << std::endl;
+      ss->begin_checkpoint(logger->begin_checkpoint());
+    }
+    advance_checkpoint(checkpoint_writes_per_operation ? checkpoint_writes_per_operation : UINT64_MAX);
+  }
+
+  // Checkpoint everything logged so far, and wait for it.  A
+  // checkpoint that is already running began before the latest
+  // operations, so it is finished first and a new one follows it.
+  // Without a log, the checkpoint's LSN is the last timestamp handed
+  // out.
+  void checkpoint_now(void)
+  {
+    if (ss->checkpoint_in_progress())
+      advance_checkpoint(UINT64_MAX);
+    ss->begin_checkpoint(logger ? logger->begin_checkpoint() : next_timestamp - 1);
+    advance_checkpoint(UINT64_MAX);
+  }
+
+  // The master record must name the new checkpoint before the log it
+  // covers is dropped, otherwise a crash in between loses every
+  // operation since the previous checkpoint.
+  void advance_checkpoint(uint64_t max_writes)
+  {
+    if (!ss->checkpoint_step(max_writes))
+      return;
+    ss->finish_checkpoint();
+    if (logger)
+      logger->finish_checkpoint();
+  }
+
+  // Push a message into the tree without logging it.  A timestamp of
+  // 0 means "use the next one"; logged operations use their LSN, so
+  // that timestamps keep increasing across a restart.
+  void apply_upsert(int opcode, Key k, Value v, uint64_t timestamp)
+  {
     message_map tmp;
-    tmp[MessageKey<Key>(k, next_timestamp++)] = Message<Value>(opcode, v);
-    pivot_map new_nodes = root->flush(*this, tmp);
+    tmp[MessageKey<Key>(k, claim_timestamp(timestamp))] = Message<Value>(opcode, v);
+    range_map no_ranges;
+    flush_root(tmp, no_ranges);
+  }
+
+  // Likewise for a range delete.
+  void apply_delete_range(Key lo, Key hi, uint64_t timestamp)
+  {
+    message_map no_elts;
+    range_map tmp;
+    tmp[MessageKey<Key>(lo, claim_timestamp(timestamp))] = hi;
+    flush_root(no_elts, tmp);
+  }
 
-    if (new_nodes.size() > 0) {
+  uint64_t claim_timestamp(uint64_t timestamp)
+  {
+    if (timestamp == 0)
+      timestamp = next_timestamp;
+    if (timestamp >= next_timestamp)
+      next_timestamp = timestamp + 1;
+    return timestamp;
+  }
+
+  // The log holds a range delete's upper bound as its value.
+  std::string encode_key(Key k)
+  {
+    std::stringstream out;
+    serialization_context ctxt(*ss, NODE_FORMAT_BINARY);
+    serialize(out, ctxt, k);
+    return out.str();
+  }
+
+  Key decode_key(const std::string &encoded)
+  {
+    std::stringstream in(encoded);
+    serialization_context ctxt(*ss, NODE_FORMAT_BINARY);
+    Key k;
+    deserialize(in, ctxt, k);
+    return k;
+  }
+
+  // Flush messages and range deletes into the root, or just buffer
+  // them there if the flusher will take care of them.
+  void flush_root(message_map &elts, range_map &rngs)
+  {
+    if (background_flushing) {
+      root->buffer(*this, elts, rngs);
+      if (root_needs_flush())
+        root_full.notify_one();
+      return;
+    }
+    // Not in one expression: the pin on the old root has to go
+    // before the root is replaced.
+    pivot_map new_nodes = root->flush(*this, elts, rngs);
+    grow_root(new_nodes);
+  }
+
+  // Grow the tree if the root split into new_nodes.  A large batch
+  // can split the root into more children than one node should hold,
+  // so keep splitting until it fits.
+  void grow_root(pivot_map &new_nodes)
+  {
+    while (new_nodes.size() > 0) {
       root = ss->allocate(new node);
       root->pivots = new_nodes;
+      if (height)
+        height++;
+      internal_nodes_changed = true;
+      if (root->pivots.size() >= max_node_size)
+        new_nodes = root->split(*this);
+      else
+        new_nodes.clear();
     }
+    ss->set_root(root);
 
-    if (logger->need_checkpoint()) {
-      std::cout << "Performing Checkpointing..." << std::endl;
-      do_checkpoint();
+    if (internal_nodes_changed && (resident_levels || resident_bytes))
+      refresh_residency();
+    internal_nodes_changed = false;
+  }
+
+  bool root_needs_flush(void) const
+  {
+    const node_pointer &r = root;
+    return r->elements.size() + r->pivots.size() > max_node_size;
+  }
+
+  // Throttle an upsert while the root is at the high watermark.
+  void wait_for_flusher(std::unique_lock<rwlock> &lock)
+  {
+    root_drained.wait(lock, [this] {
+      if (!background_flushing)
+        return true;
+      const node_pointer &r = root;
+      return r->elements.size() + r->pivots.size() < flush_high_watermark;
+    });
+  }
+
+  // The background flusher.  It takes the tree for one step at a time,
+  // so upserts and queries get in between steps.
+  void flusher_loop(void)
+  {
+    std::unique_lock<rwlock> lock(tree_mutex);
+    while (true) {
+      root_full.wait(lock, [this] { return flusher_stopping || root_needs_flush(); });
+      if (flusher_stopping)
+        break;
+      pivot_map new_nodes = root->drain(*this);
+      grow_root(new_nodes);
+      root_drained.notify_all();
+      lock.unlock();
+      std::this_thread::yield();
+      lock.lock();
     }
   }
 
+  void stop_flusher(void)
+  {
+    if (!flusher.joinable())
+      return;
+    {
+      std::unique_lock<rwlock> lock(tree_mutex);
+      background_flushing = false;
+      flusher_stopping = true;
+      root_full.notify_one();
+      root_drained.notify_all();
+    }
+    flusher.join();
+  }
+
+  // Choose the resident internal nodes (see set_resident_levels())
+  // breadth first from the root, and hand them to the swap space.
+  void refresh_residency(void)
+  {
+    if (resident_levels || resident_bytes) {
+      if (height == 0)
+        height = measure_height();
+      std::vector<node_pointer> level(1, root);
+      uint64_t bytes = 0;
+      bool full = false;
+      for (uint64_t depth = 0; depth + 1 < height && !full; depth++) {
+        std::vector<node_pointer> next;
+        for (const node_pointer &n : level) {
+          uint64_t footprint = n->footprint();
+          if (depth >= resident_levels && (bytes += footprint) > resident_bytes) {
+            full = true;
+            break;
+          }
+          if (!n.keep_resident()) {
+            full = true;
+            break;
+          }
+          for (auto it = n->pivots.begin(); it != n->pivots.end(); ++it)
+            next.push_back(it->second.child);
+        }
+        level.swap(next);
+      }
+    }
+    ss->end_resident_round();
+  }
+
+  // All leaves are at the same depth, so follow the leftmost path.
+  uint64_t measure_height(void) const
+  {
+    uint64_t h = 1;
+    for (node_pointer n = root; ; h++) {
+      const node_pointer &cn = n;
+      if (cn->is_leaf())
+        return h;
+      n = cn->pivots.begin()->second.child;
+    }
+  }
+
+public:
+
   void insert(Key k, Value v)
   {
     upsert(INSERT, k, v);
@@ -728,35 +1605,233 @@ public:
   {
     upsert(DELETE, k, default_value);
   }
+
+  // Delete every key in [lo, hi).  This is one operation, however
+  // many keys the range holds: it is logged once and goes down the
+  // tree as a single message, taking out older messages for the range
+  // in each node it reaches.
+  void erase_range(Key lo, Key hi)
+  {
+    if (!(lo < hi))
+      return;
+    std::unique_lock<rwlock> lock(tree_mutex);
+    wait_for_flusher(lock);
+    uint64_t timestamp = 0;
+    if (logger){
+      timestamp = logger->log_operation(DELETE_RANGE, lo, encode_key(hi));
+    } else {
+      std::cerr << "Logger has not been initialized" << std::endl;
+    }
+
+    apply_delete_range(lo, hi, timestamp);
+
+    maybe_checkpoint();
+  }
   
-  Value query(Key k)
+  // Returns the value for k, or nothing if k is not in the tree.
+  std::optional<Value> try_query(Key k)
   {
-    Value v = root->query(*this, k);
+    std::shared_lock<rwlock> lock(tree_mutex);
+    // Through a const pointer, so that lookups do not dirty the root.
+    const node_pointer &r = root;
+    Value v;
+    if (!r->query(*this, k, v))
+      return std::nullopt;
     return v;
   }
 
-  void dump_messages(void) {
-    std::pair<MessageKey<Key>, Message<Value> > current;
+  // Throws std::out_of_range if k is not in the tree.
+  Value query(Key k)
+  {
+    std::optional<Value> v = try_query(k);
+    if (!v)
+      throw std::out_of_range("Key does not exist");
+    return *v;
+  }
 
+  void dump_messages(void) {
+    std::shared_lock<rwlock> lock(tree_mutex);
     std::cout << "############### BEGIN DUMP ##############" << std::endl;
     
-    try {
-      current = root->get_next_message(NULL);
-      do { 
-	std::cout << current.first.key       << " "
-		  << current.first.timestamp << " "
-		  << current.second.opcode   << " "
-		  << current.second.val      << std::endl;
-	current = root->get_next_message(&current.first);
-      } while (1);
-    } catch (std::out_of_range e) {}
+    for (scan_cursor cursor(root, NULL); cursor.valid(); cursor.next()) {
+      std::cout << cursor.key().key       << " "
+		<< cursor.key().timestamp << " "
+		<< cursor.message().opcode   << " "
+		<< cursor.message().val      << std::endl;
+    }
   }
 
+private:
+  // Walks every message in the tree in MessageKey order, i.e. the
+  // order in which get_next_message used to return them one root
+  // descent at a time.
+
+  // The cursor keeps the path from the root to the current leaf on a
+  // stack, with each node on it pinned, and a position in each of
+  // their buffers.  Messages in the buffers along the path and in the
+  // leaf are merged as we go, so each node is visited once per scan.
+
+  // Every key under the child we are scanning lies below that
+  // child's next pivot, and below the next pivots further up the
+  // path (together, the "limit").  Buffered messages at or past the
+  // limit belong to subtrees we have not reached yet, so they wait.
+
+  // The cursor is invalidated by any modification of the tree.
+  class scan_cursor {
+  public:
+    scan_cursor(void) {}
+
+    // Position at the first message greater than *mkey, or at the
+    // first message if mkey is NULL.
+    scan_cursor(const node_pointer &root, const MessageKey<Key> *mkey) {
+      path.reserve(8);
+      descend(root, mkey);
+      find_next();
+    }
+
+    bool valid(void) const {
+      return current >= 0;
+    }
+
+    const MessageKey<Key> &key(void) const {
+      return path[current].elt->first;
+    }
+
+    const Message<Value> &message(void) const {
+      return path[current].elt->second;
+    }
+
+    void next(void) {
+      ++path[current].elt;
+      find_next();
+    }
+
+  private:
+    struct frame {
+      typename swap_space::pin<node> pinned;
+      const node *n;
+      typename message_map::const_iterator elt;   // Next unconsumed message
+      typename pivot_map::const_iterator child;   // Child we are scanning
+      bool limited;
+      Key limit;
+    };
+
+    // Push the path down to the leftmost leaf under ptr, starting
+    // each node's buffer after *mkey.
+    void descend(const node_pointer &ptr, const MessageKey<Key> *mkey) {
+      node_pointer p = ptr;
+      while (true) {
+	path.push_back(frame());
+	frame &f = path.back();
+	f.pinned = p.get_pin();
+	const typename swap_space::pin<node> &cpin = f.pinned;
+	f.n = cpin.operator->();
+	f.elt = mkey ? f.n->elements.upper_bound(*mkey) : f.n->elements.begin();
+	inherit_limit();
+	if (f.n->is_leaf())
+	  return;
+
+	if (mkey && *mkey < f.n->pivots.begin()->first)
+	  mkey = NULL;
+	f.child = mkey ? f.n->get_pivot(mkey->key) : f.n->pivots.begin();
+	tighten_limit();
+	prefetch_next_child();
+	p = f.child->second.child;
+      }
+    }
+
+    // The top frame starts with its parent's limit...
+    void inherit_limit(void) {
+      frame &f = path.back();
+      f.limited = path.size() > 1 && path[path.size() - 2].limited;
+      if (f.limited)
+	f.limit = path[path.size() - 2].limit;
+    }
+
+    // ...and adds the next pivot after the child it is scanning.
+    void tighten_limit(void) {
+      frame &f = path.back();
+      auto next_child = std::next(f.child);
+      if (next_child != f.n->pivots.end() && (!f.limited || next_child->first < f.limit)) {
+	f.limited = true;
+	f.limit = next_child->first;
+      }
+    }
+
+    // Start loading the sibling we will scan after the top frame's
+    // current child.
+    void prefetch_next_child(void) {
+      frame &f = path.back();
+      auto next_child = std::next(f.child);
+      if (next_child != f.n->pivots.end())
+	next_child->second.child.prefetch();
+    }
+
+    // Point current at the smallest message we can return now,
+    // moving on to the next subtree whenever the current one is used
+    // up.
+    void find_next(void) {
+      current = -1;
+      while (!path.empty()) {
+	// Limits only tighten going down.
+	const frame &bottom = path.back();
+	for (size_t i = 0; i < path.size(); i++) {
+	  const frame &f = path[i];
+	  if (f.elt == f.n->elements.end())
+	    continue;
+	  if (bottom.limited && !(f.elt->first.key < bottom.limit))
+	    continue;
+	  if (current < 0 || f.elt->first < path[current].elt->first)
+	    current = i;
+	}
+	if (current >= 0 && shadowed(current)) {
+	  ++path[current].elt;
+	  current = -1;
+	  continue;
+	}
+	if (current >= 0)
+	  return;
+
+	// Nothing left below the bottom frame, so move its parent on
+	// to its next child.  Once a node has no children left, its
+	// own remaining messages come into range.
+	path.pop_back();
+	if (path.empty())
+	  return;
+	frame &f = path.back();
+	++f.child;
+	inherit_limit();
+	if (f.child != f.n->pivots.end()) {
+	  tighten_limit();
+	  prefetch_next_child();
+	  descend(f.child->second.child, NULL);
+	}
+      }
+    }
+
+    // Whether a range delete buffered above frame i covers its next
+    // message.  Range deletes are older than the messages in their
+    // own node, so only ancestors' count.
+    bool shadowed(int i) const {
+      const Key &k = path[i].elt->first.key;
+      for (int j = 0; j < i; j++)
+	if (path[j].n->range_deleted(path[j].child, k))
+	  return true;
+      return false;
+    }
+
+    std::vector<frame> path;
+    int current = -1;
+  };
+
+public:
+
   class iterator {
   public:
 
     iterator(const betree &bet)
       : bet(bet),
+	lock(),
 	position(),
 	is_valid(false),
 	pos_is_valid(false),
@@ -766,17 +1841,28 @@ public:
 
     iterator(const betree &bet, const MessageKey<Key> *mkey)
       : bet(bet),
-	position(),	
+	lock(bet.tree_mutex),
+	position(bet.root, mkey),
 	is_valid(false),
-	pos_is_valid(false),
+	pos_is_valid(position.valid()),
 	first(),
 	second()
     {
-      try {
-	position = bet.root->get_next_message(mkey);
-	pos_is_valid = true;
-	setup_next_element();
-      } catch (std::out_of_range & e) {}
+      setup_next_element();
+    }
+
+    // Over a snapshot, which the tree's lock does not cover.
+    iterator(const snapshot &snap, const MessageKey<Key> *mkey)
+      : bet(*snap.bet),
+	lock(),
+	view(snap.view),
+	position(snap.root, mkey),
+	is_valid(false),
+	pos_is_valid(position.valid()),
+	first(),
+	second()
+    {
+      setup_next_element();
     }
 
     void apply(const MessageKey<Key> &msgkey, const Message<Value> &msg) {
@@ -790,7 +1876,7 @@ public:
   	first = msgkey.key;
   	if (is_valid == false)
   	  second = bet.default_value;
-  	second = second + msg.val;
+  	MergeOperator::full_merge(second, msg.val);
   	is_valid = true;
   	break;
       case DELETE:
@@ -804,13 +1890,10 @@ public:
 
     void setup_next_element(void) {
       is_valid = false;
-      while (pos_is_valid && (!is_valid || position.first.key == first)) {
-	apply(position.first, position.second);
-	try {
-	  position = bet.root->get_next_message(&position.first);
-	} catch (std::exception & e) {
-	  pos_is_valid = false;
-	}
+      while (pos_is_valid && (!is_valid || position.key().key == first)) {
+	apply(position.key(), position.message());
+	position.next();
+	pos_is_valid = position.valid();
       }
     }
 
@@ -818,7 +1901,7 @@ public:
       return &bet == &other.bet &&
 	is_valid == other.is_valid &&
 	pos_is_valid == other.pos_is_valid &&
-	(!pos_is_valid || position == other.position) &&
+	(!pos_is_valid || position.key() == other.position.key()) &&
 	(!is_valid || (first == other.first && second == other.second));
     }
 
@@ -832,7 +1915,9 @@ public:
     }
     
     const betree &bet;
-    std::pair<MessageKey<Key>, Message<Value> > position;
+    std::shared_lock<rwlock> lock;  // Not held by end() or over a snapshot
+    std::shared_ptr<swap_snapshot> view;  // Kept alive while we scan it
+    scan_cursor position;
     bool is_valid;
     bool pos_is_valid;
     Key first;
@@ -856,5 +1941,67 @@ public:
   iterator end(void) const {
     return iterator(*this);
   }
+
+  // The tree as of a checkpoint.  Queries and scans see that state
+  // however the tree changes afterwards, and do not wait for writers.
+  // The node versions it reads stay on disk until the last copy of the
+  // snapshot, and the last iterator over it, are gone.  Nodes are read
+  // from the backing store rather than the cache; see swap_space.hpp.
+  // The tree must outlive its snapshots.
+  class snapshot {
+  public:
+    typedef typename betree::iterator iterator;
+
+    uint64_t lsn(void) const {
+      return view->get_lsn();
+    }
+
+    std::optional<Value> try_query(Key k) const {
+      Value v;
+      if (!root->query(*bet, k, v))
+	return std::nullopt;
+      return v;
+    }
+
+    // Throws std::out_of_range if k is not in the snapshot.
+    Value query(Key k) const {
+      std::optional<Value> v = try_query(k);
+      if (!v)
+	throw std::out_of_range("Key does not exist");
+      return *v;
+    }
+
+    iterator begin(void) const {
+      return iterator(*this, NULL);
+    }
+
+    iterator lower_bound(Key key) const {
+      MessageKey<Key> tmp = MessageKey<Key>::range_start(key);
+      return iterator(*this, &tmp);
+    }
+
+    iterator upper_bound(Key key) const {
+      MessageKey<Key> tmp = MessageKey<Key>::range_end(key);
+      return iterator(*this, &tmp);
+    }
+
+    iterator end(void) const {
+      return iterator(*bet);
+    }
+
+  private:
+    friend class betree;
+    friend iterator;
+
+    snapshot(const betree &bet, std::shared_ptr<swap_snapshot> view)
+      : bet(&bet),
+	view(view),
+	root(swap_space::get_snapshot_root<node>(*view))
+    {}
+
+    const betree *bet;
+    std::shared_ptr<swap_snapshot> view;
+    node_pointer root;
+  };
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,116 @@
+// A Bloom filter over 64-bit key hashes.
+
+// A filter is sized for a number of keys (its capacity) at a given
+// number of bits per key.  Keys can be added but not removed, so a
+// filter whose keys come and go fills up with stale bits; full()
+// says when it has absorbed more keys than it was sized for, at
+// which point the owner should rebuild it from the keys it really
+// holds.  Until then the false-positive rate stays at or below the
+// rate for the capacity.
+
+// Probes are derived from one hash by double hashing (Kirsch and
+// Mitzenmacher), so callers hash each key once.
+
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "swap_space.hpp"
+
+// Spread std::hash, which is the identity for integers, over all 64
+// bits.  This is the splitmix64 finalizer.
+template <class Key>
+uint64_t bloom_hash(const Key &k)
+{
+  uint64_t h = std::hash<Key>()(k);
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+class bloom_filter : public serializable {
+public:
+  bloom_filter(void) {}
+
+  bloom_filter(uint64_t capacity, uint64_t bits_per_key) {
+    reset(capacity, bits_per_key);
+  }
+
+  // Empty the filter and size it for capacity keys.
+  void reset(uint64_t capacity, uint64_t bits_per_key) {
+    this->capacity = capacity;
+    inserted = 0;
+    probes = bits_per_key * 69 / 100;  // ln 2 per bit
+    if (probes < 1)
+      probes = 1;
+    if (probes > 30)
+      probes = 30;
+    bits.assign((capacity * bits_per_key + 63) / 64 + 1, 0);
+  }
+
+  void add(uint64_t h) {
+    uint64_t nbits = bits.size() * 64;
+    uint64_t delta = (h >> 33) | (h << 31);
+    for (uint64_t i = 0; i < probes; i++) {
+      uint64_t bit = h % nbits;
+      bits[bit / 64] |= 1ULL << (bit % 64);
+      h += delta;
+    }
+    inserted++;
+  }
+
+  bool may_contain(uint64_t h) const {
+    uint64_t nbits = bits.size() * 64;
+    uint64_t delta = (h >> 33) | (h << 31);
+    for (uint64_t i = 0; i < probes; i++) {
+      uint64_t bit = h % nbits;
+      if (!(bits[bit / 64] & (1ULL << (bit % 64))))
+        return false;
+      h += delta;
+    }
+    return true;
+  }
+
+  bool full(void) const {
+    return inserted > capacity;
+  }
+
+  void _serialize(std::iostream &fs, serialization_context &context) {
+    serialize(fs, context, capacity);
+    serialize_text(fs, context, " ");
+    serialize(fs, context, inserted);
+    serialize_text(fs, context, " ");
+    serialize(fs, context, probes);
+    serialize_text(fs, context, " ");
+    serialize(fs, context, (uint64_t)bits.size());
+    for (auto w : bits) {
+      serialize_text(fs, context, " ");
+      serialize(fs, context, w);
+    }
+  }
+
+  void _deserialize(std::iostream &fs, serialization_context &context) {
+    uint64_t words;
+    deserialize(fs, context, capacity);
+    deserialize(fs, context, inserted);
+    deserialize(fs, context, probes);
+    deserialize(fs, context, words);
+    bits.resize(words);
+    for (auto &w : bits)
+      deserialize(fs, context, w);
+  }
+
+  uint64_t footprint(void) const {
+    return sizeof(*this) + bits.size() * sizeof(uint64_t);
+  }
+
+private:
+  uint64_t capacity = 0;
+  uint64_t inserted = 0;
+  uint64_t probes = 1;
+  std::vector<uint64_t> bits;
+};
+
+#endif // BLOOM_FILTER_HPP
@@ -0,0 +1,87 @@
+#include <cstring>
+#include "crc32c.hpp"
+
+// Reflected Castagnoli polynomial.
+#define CRC32C_POLY (0x82f63b78U)
+
+static uint32_t crc32c_table[8][256];
+
+static bool crc32c_init_tables(void)
+{
+  for (uint32_t i = 0; i < 256; i++)
+  {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+    crc32c_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++)
+    for (int t = 1; t < 8; t++)
+      crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+  return true;
+}
+
+// Slicing-by-8: consume eight bytes per step with eight table lookups.
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  static const bool tables_ready = crc32c_init_tables();
+  (void)tables_ready;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xff] ^
+          crc32c_table[6][(word >> 8) & 0xff] ^
+          crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^
+          crc32c_table[0][word >> 56];
+    p += 8;
+    len -= 8;
+  }
+#endif
+  while (len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t crc64 = crc;
+  while (len >= 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (len--)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+
+static bool crc32c_have_hw(void)
+{
+  static const bool have_hw = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+  return have_hw;
+}
+#endif
+
+uint32_t crc32c_extend(uint32_t crc, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (crc32c_have_hw())
+    return ~crc32c_hw(crc, p, len);
+#endif
+  return ~crc32c_sw(crc, p, len);
+}
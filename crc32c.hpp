@@ -0,0 +1,19 @@
+// CRC-32C (Castagnoli), used to checksum on-disk nodes and log
+// records.  Uses the SSE4.2 crc32 instruction when the CPU has it and
+// a table-driven implementation otherwise.
+
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+// Extend crc with the len bytes at data.  Start from 0.
+uint32_t crc32c_extend(uint32_t crc, const void *data, size_t len);
+
+inline uint32_t crc32c(const void *data, size_t len)
+{
+  return crc32c_extend(0, data, len);
+}
+
+#endif // CRC32C_HPP
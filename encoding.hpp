@@ -0,0 +1,66 @@
+// Fixed-width little-endian integer encoding, used by the binary
+// on-disk formats so that files do not depend on the host byte order.
+
+#ifndef ENCODING_HPP
+#define ENCODING_HPP
+
+#include <cstdint>
+#include <string>
+
+inline void encode_fixed16(char *buf, uint16_t x)
+{
+  for (int i = 0; i < 2; i++)
+    buf[i] = (char)(x >> (8 * i));
+}
+
+inline void encode_fixed32(char *buf, uint32_t x)
+{
+  for (int i = 0; i < 4; i++)
+    buf[i] = (char)(x >> (8 * i));
+}
+
+inline void encode_fixed64(char *buf, uint64_t x)
+{
+  for (int i = 0; i < 8; i++)
+    buf[i] = (char)(x >> (8 * i));
+}
+
+inline uint16_t decode_fixed16(const char *buf)
+{
+  const unsigned char *b = (const unsigned char *)buf;
+  return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+inline uint32_t decode_fixed32(const char *buf)
+{
+  const unsigned char *b = (const unsigned char *)buf;
+  uint32_t x = 0;
+  for (int i = 3; i >= 0; i--)
+    x = (x << 8) | b[i];
+  return x;
+}
+
+inline uint64_t decode_fixed64(const char *buf)
+{
+  const unsigned char *b = (const unsigned char *)buf;
+  uint64_t x = 0;
+  for (int i = 7; i >= 0; i--)
+    x = (x << 8) | b[i];
+  return x;
+}
+
+inline void put_fixed32(std::string &dst, uint32_t x)
+{
+  char buf[4];
+  encode_fixed32(buf, x);
+  dst.append(buf, sizeof(buf));
+}
+
+inline void put_fixed64(std::string &dst, uint64_t x)
+{
+  char buf[8];
+  encode_fixed64(buf, x);
+  dst.append(buf, sizeof(buf));
+}
+
+#endif // ENCODING_HPP
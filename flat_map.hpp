@@ -0,0 +1,318 @@
+// A sorted associative container backed by contiguous arrays.  It
+// provides the subset of the std::map interface that the betree uses,
+// so a node can keep its pivots and message buffer in it instead of
+// a std::map.
+
+// Keys and values live in two separate std::vectors kept in the same
+// order.  Lookups binary-search the key array only, so a search
+// touches a handful of cache lines instead of chasing red-black tree
+// nodes across the heap, and a node with N entries costs two
+// allocations instead of N.
+
+// There is no std::pair in memory, so dereferencing an iterator
+// yields a small proxy whose "first" and "second" members are
+// references into the two arrays.  Code written against std::map
+// (it->first, it->second.some_field) works unchanged.
+
+// WARNING: unlike std::map, and like std::vector, inserting or
+//          erasing invalidates all iterators at or after the point of
+//          modification (and all iterators if the arrays grow).
+
+#ifndef FLAT_MAP_HPP
+#define FLAT_MAP_HPP
+
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <cstddef>
+
+template<class Key, class Value>
+class flat_map {
+public:
+  typedef Key key_type;
+  typedef Value mapped_type;
+  typedef size_t size_type;
+
+  template<bool Const>
+  class basic_iterator {
+    friend class flat_map;
+    template<bool> friend class basic_iterator;
+
+    typedef typename std::conditional<Const, const flat_map, flat_map>::type map_type;
+    typedef typename std::conditional<Const, const Value, Value>::type value_ref_type;
+
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef std::pair<Key, Value> value_type;
+    typedef ptrdiff_t difference_type;
+
+    class reference {
+    public:
+      reference(const Key &k, value_ref_type &v)
+	: first(k),
+	  second(v)
+      {}
+
+      operator std::pair<Key, Value>(void) const {
+	return std::pair<Key, Value>(first, second);
+      }
+
+      const Key &first;
+      value_ref_type &second;
+    };
+
+    // operator-> has to return something that itself has an
+    // operator->, so we wrap the proxy.
+    class pointer {
+    public:
+      pointer(const reference &r) : ref(r) {}
+      const reference * operator->(void) const { return &ref; }
+    private:
+      reference ref;
+    };
+
+    basic_iterator(void)
+      : mp(NULL),
+	idx(0)
+    {}
+
+    // Also lets an iterator convert to a const_iterator.
+    basic_iterator(const basic_iterator<false> &other)
+      : mp(other.mp),
+	idx(other.idx)
+    {}
+
+    reference operator*(void) const {
+      return reference(mp->keys[idx], mp->values[idx]);
+    }
+
+    pointer operator->(void) const {
+      return pointer(operator*());
+    }
+
+    reference operator[](difference_type n) const {
+      return *(*this + n);
+    }
+
+    basic_iterator &operator++(void) { ++idx; return *this; }
+    basic_iterator &operator--(void) { --idx; return *this; }
+    basic_iterator operator++(int) { basic_iterator tmp = *this; ++idx; return tmp; }
+    basic_iterator operator--(int) { basic_iterator tmp = *this; --idx; return tmp; }
+    basic_iterator &operator+=(difference_type n) { idx += n; return *this; }
+    basic_iterator &operator-=(difference_type n) { idx -= n; return *this; }
+    basic_iterator operator+(difference_type n) const { return basic_iterator(mp, idx + n); }
+    basic_iterator operator-(difference_type n) const { return basic_iterator(mp, idx - n); }
+
+    template<bool C>
+    difference_type operator-(const basic_iterator<C> &other) const {
+      return (difference_type)idx - (difference_type)other.idx;
+    }
+
+    template<bool C>
+    bool operator==(const basic_iterator<C> &other) const {
+      return mp == other.mp && idx == other.idx;
+    }
+
+    template<bool C>
+    bool operator!=(const basic_iterator<C> &other) const {
+      return !operator==(other);
+    }
+
+    template<bool C>
+    bool operator<(const basic_iterator<C> &other) const {
+      return idx < other.idx;
+    }
+
+    size_t index(void) const {
+      return idx;
+    }
+
+  private:
+    basic_iterator(map_type *m, size_t i)
+      : mp(m),
+	idx(i)
+    {}
+
+    map_type *mp;
+    size_t idx;
+  };
+
+  typedef basic_iterator<false> iterator;
+  typedef basic_iterator<true> const_iterator;
+
+  flat_map(void) {}
+
+  // Build from a range of (key, value) pairs.  This is linear when
+  // the range is sorted, e.g. when it comes from another map.
+  template<class InputIterator>
+  flat_map(InputIterator first, InputIterator last) {
+    for (; first != last; ++first)
+      emplace_hint(end(), first->first, first->second);
+  }
+
+  size_t size(void) const { return keys.size(); }
+  bool empty(void) const { return keys.empty(); }
+
+  void clear(void) {
+    keys.clear();
+    values.clear();
+  }
+
+  void reserve(size_t n) {
+    keys.reserve(n);
+    values.reserve(n);
+  }
+
+  void swap(flat_map &other) {
+    keys.swap(other.keys);
+    values.swap(other.values);
+  }
+
+  iterator begin(void) { return iterator(this, 0); }
+  iterator end(void) { return iterator(this, keys.size()); }
+  const_iterator begin(void) const { return const_iterator(this, 0); }
+  const_iterator end(void) const { return const_iterator(this, keys.size()); }
+
+  iterator lower_bound(const Key &k) {
+    return iterator(this, lower_bound_index(k));
+  }
+
+  const_iterator lower_bound(const Key &k) const {
+    return const_iterator(this, lower_bound_index(k));
+  }
+
+  iterator upper_bound(const Key &k) {
+    return iterator(this, upper_bound_index(k));
+  }
+
+  const_iterator upper_bound(const Key &k) const {
+    return const_iterator(this, upper_bound_index(k));
+  }
+
+  iterator find(const Key &k) {
+    size_t i = lower_bound_index(k);
+    return i < keys.size() && !(k < keys[i]) ? iterator(this, i) : end();
+  }
+
+  const_iterator find(const Key &k) const {
+    size_t i = lower_bound_index(k);
+    return i < keys.size() && !(k < keys[i]) ? const_iterator(this, i) : end();
+  }
+
+  size_t count(const Key &k) const {
+    return find(k) == end() ? 0 : 1;
+  }
+
+  Value &operator[](const Key &k) {
+    size_t i = lower_bound_index(k);
+    if (i == keys.size() || k < keys[i]) {
+      keys.insert(keys.begin() + i, k);
+      values.insert(values.begin() + i, Value());
+    }
+    return values[i];
+  }
+
+  // Insert (k, v) if k is not already present.  A hint of end() for
+  // a key larger than everything in the map is an O(1) append, which
+  // is how nodes get built in key order.
+  template<class V>
+  iterator emplace_hint(const_iterator hint, const Key &k, V &&v) {
+    if (hint.idx == keys.size() && (keys.empty() || keys.back() < k)) {
+      keys.push_back(k);
+      values.push_back(std::forward<V>(v));
+      return iterator(this, keys.size() - 1);
+    }
+    size_t i = lower_bound_index(k);
+    if (i == keys.size() || k < keys[i]) {
+      keys.insert(keys.begin() + i, k);
+      values.insert(values.begin() + i, std::forward<V>(v));
+    }
+    return iterator(this, i);
+  }
+
+  std::pair<iterator, bool> insert(const std::pair<Key, Value> &kv) {
+    size_t i = lower_bound_index(kv.first);
+    if (i < keys.size() && !(kv.first < keys[i]))
+      return std::make_pair(iterator(this, i), false);
+    keys.insert(keys.begin() + i, kv.first);
+    values.insert(values.begin() + i, kv.second);
+    return std::make_pair(iterator(this, i), true);
+  }
+
+  // Insert every pair in a sorted range whose key is not already
+  // present.  This is a single linear merge rather than one shifting
+  // insertion per element.
+  template<class InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    if (first == last)
+      return;
+    if (keys.empty() || keys.back() < first->first) {
+      for (; first != last; ++first)
+	emplace_hint(end(), first->first, first->second);
+      return;
+    }
+
+    std::vector<Key> new_keys;
+    std::vector<Value> new_values;
+    new_keys.reserve(keys.size());
+    new_values.reserve(values.size());
+    size_t i = 0;
+    while (i < keys.size() || first != last) {
+      if (first == last || (i < keys.size() && !(first->first < keys[i]))) {
+	if (first != last && !(keys[i] < first->first))
+	  ++first; // Already present, existing entry wins
+	new_keys.push_back(std::move(keys[i]));
+	new_values.push_back(std::move(values[i]));
+	i++;
+      } else {
+	new_keys.push_back(first->first);
+	new_values.push_back(first->second);
+	++first;
+      }
+    }
+    keys.swap(new_keys);
+    values.swap(new_values);
+  }
+
+  // Overwrite the entry at pos with (k, v).  k must sort into the
+  // same position, e.g. a newer version of the same logical key.
+  template<class V>
+  void replace(const_iterator pos, const Key &k, V &&v) {
+    keys[pos.idx] = k;
+    values[pos.idx] = std::forward<V>(v);
+  }
+
+  iterator erase(const_iterator pos) {
+    return erase(pos, pos + 1);
+  }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    keys.erase(keys.begin() + first.idx, keys.begin() + last.idx);
+    values.erase(values.begin() + first.idx, values.begin() + last.idx);
+    return iterator(this, first.idx);
+  }
+
+  size_t erase(const Key &k) {
+    iterator it = find(k);
+    if (it == end())
+      return 0;
+    erase(it);
+    return 1;
+  }
+
+private:
+  size_t lower_bound_index(const Key &k) const {
+    return std::lower_bound(keys.begin(), keys.end(), k) - keys.begin();
+  }
+
+  size_t upper_bound_index(const Key &k) const {
+    return std::upper_bound(keys.begin(), keys.end(), k) - keys.begin();
+  }
+
+  std::vector<Key> keys;
+  std::vector<Value> values;
+};
+
+#endif // FLAT_MAP_HPP
@@ -1,72 +1,161 @@
+// Write-ahead log with group commit.
+
+// Records are appended to a user-space buffer and become durable in
+// groups: a group is written out with a single write() and made
+// durable with a single fdatasync().  A group is committed when it
+// holds persistence_granularity records, or when its oldest record
+// has waited group_commit_interval microseconds, whichever comes
+// first.  The time limit is enforced by a background thread, so a
+// trickle of writes still becomes durable promptly.
+
+// Records are binary and individually checksummed; see
+// wal_format.hpp.
+
+// Every record gets a log sequence number (LSN).  get_durable_lsn()
+// tells callers how far the log is known to be on disk, and sync()
+// forces everything logged so far to disk.
+
+// Checkpoints run alongside new operations, so the log cannot simply
+// be truncated when one starts.  Instead the log is kept in two files
+// that take turns: begin_checkpoint() leaves the records the
+// checkpoint covers in the current file and carries on in the other
+// one, and finish_checkpoint() empties the first file once the
+// checkpoint is published.  Both files exist from the start, so
+// switching between them needs no directory updates.
+
 #ifndef LOGGER_HPP
 #define LOGGER_HPP
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <cassert>
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <tuple>
+#include <vector>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "backing_store.hpp"
 #include "swap_space.hpp"
+#include "wal_format.hpp"
+
+// In microseconds.  0 disables the time-based limit.
+#define DEFAULT_GROUP_COMMIT_INTERVAL (10000)
 
 class Logger {
 public:
-    Logger(backing_store* storage, uint64_t persistence_granularity, uint64_t checkpoint_granularity)
+    Logger(backing_store* storage, uint64_t persistence_granularity, uint64_t checkpoint_granularity,
+           uint64_t group_commit_interval = DEFAULT_GROUP_COMMIT_INTERVAL)
         : storage(storage),
-          persistence_granularity(persistence_granularity), 
-          log_count(0), 
+          persistence_granularity(persistence_granularity),
+          log_count(0),
           lsn(0),
+          durable_lsn(0),
           checkpoint_granularity(checkpoint_granularity),
-          operations_after_last_checkpoint(0) {
+          operations_after_last_checkpoint(0),
+          group_commit_interval(group_commit_interval),
+          stopping(false) {
 
-        log_stream.open("wal_log.txt", std::ios::out | std::ios::app);  // file handling
-        
-        if (!log_stream.is_open()) {
+        log_fd = open(WAL_FILENAME, O_RDWR | O_CREAT | O_APPEND, 0644);  // file handling
+        standby_fd = open(WAL_ALT_FILENAME, O_RDWR | O_CREAT | O_APPEND, 0644);
+
+        if (log_fd < 0 || standby_fd < 0) {
             std::cerr << "Failed to open log file for WAL" << std::endl;
             exit(1);
         }
 
+        // Carry on in whichever file has the newest records.
+        uint64_t first_lsn, alt_first_lsn;
+        if (read_first_wal_lsn(WAL_ALT_FILENAME, alt_first_lsn) &&
+            (!read_first_wal_lsn(WAL_FILENAME, first_lsn) || alt_first_lsn > first_lsn))
+            std::swap(log_fd, standby_fd);
+
+        if (group_commit_interval > 0)
+            group_timer = std::thread(&Logger::group_timer_loop, this);
     }
 
     ~Logger() {
-        if (log_stream.is_open()) {
-            log_stream.close();
+        if (group_timer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(buffer_mutex);
+                stopping = true;
+            }
+            timer_cv.notify_one();
+            group_timer.join();
         }
+        sync();
+        close(log_fd);
+        close(standby_fd);
     }
 
-    void log_operation(int opcode, uint64_t key, const std::string& value){
-        lsn ++;
+    // Append a record to the current group and return its LSN.  The
+    // record is durable once get_durable_lsn() reaches that LSN.
+    uint64_t log_operation(int opcode, uint64_t key, const std::string& value){
+        uint64_t record_lsn;
+        bool group_full;
+        {
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            record_lsn = ++lsn;
 
-        if (!log_stream.is_open()){
-            std::cerr << "Logging file is not open!" << std::endl;
-            return;
-        }
-        
-        // Logging operation type
-        log_stream << lsn << " ";
-        switch (opcode) {
-            case 0: log_stream << "INSERT "; break;
-            case 1: log_stream << "DELETE "; break;
-            case 2: log_stream << "UPDATE "; break;
-        }
+            if (log_count == 0)
+                group_start = std::chrono::steady_clock::now();
+
+            encode_wal_record(buffer, record_lsn, opcode, key, value);
 
-        log_stream << key;
+            log_count++;
+            operations_after_last_checkpoint++;
+            group_full = log_count >= persistence_granularity;
+        }
 
-        if (!value.empty()) {
-            log_stream << " " << value;
+        // Persist if log count reaches persistence granularity
+        if (group_full) {
+            persist();
         }
+        return record_lsn;
+    }
 
-        log_stream << std::endl;
+    // Append a batch of (opcode, key, value) tuples and return the
+    // LSN of the first; the rest get consecutive LSNs.  The whole
+    // batch lands in one group, so it becomes durable all at once.
+    template<class ForwardIterator>
+    uint64_t log_batch(ForwardIterator first, ForwardIterator last) {
+        uint64_t first_lsn;
+        bool group_full;
+        {
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            first_lsn = lsn + 1;
 
-        log_count++;
-        operations_after_last_checkpoint++;
+            if (log_count == 0)
+                group_start = std::chrono::steady_clock::now();
 
-        // Persist if log count reaches persistence granularity
-        if (log_count >= persistence_granularity) {
-            persist(); 
+            for (; first != last; ++first) {
+                encode_wal_record(buffer, ++lsn, std::get<0>(*first), std::get<1>(*first), std::get<2>(*first));
+                log_count++;
+                operations_after_last_checkpoint++;
+            }
+            group_full = log_count >= persistence_granularity;
+        }
+
+        if (group_full) {
+            persist();
         }
+        return first_lsn;
+    }
+
+    // Commit the current group, if any.  On return every record
+    // logged so far is durable.
+    void sync() {
+        persist();
     }
 
     bool log_exists() const {
-        std::ifstream log_file("wal_log.txt");
+        std::ifstream log_file(WAL_FILENAME);
         return log_file.good();
     }
 
@@ -79,48 +168,153 @@ public:
         return lsn;
     }
 
-    void checkpoint(uint64_t lsn) {
-        // log_stream << "Checkpoint at" << lsn << std::endl;
-        log_stream.flush();
+    uint64_t get_durable_lsn() const {
+        return durable_lsn;
+    }
 
-        // // Update master record
-        // ss->update_master_record();
+    // Continue numbering after the records found during recovery.
+    // Everything up to last_lsn is already on disk.
+    void resume(uint64_t last_lsn, uint64_t checkpoint_lsn) {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        assert(buffer.empty());
+        lsn = last_lsn;
+        durable_lsn = last_lsn;
+        operations_after_last_checkpoint = last_lsn - checkpoint_lsn;
+    }
 
-        // Truncate log file
-        if (log_stream.is_open()){
-            log_stream.close(); // close to change mode
-        }
+    // A checkpoint of everything logged so far is starting.  Returns
+    // the LSN it covers.
+    uint64_t begin_checkpoint() {
+        std::lock_guard<std::mutex> commit_lock(commit_mutex);
+        commit_group();
 
-        log_stream.open("wal_log.txt", std::ios::out | std::ios::trunc);
-        if (!log_stream.is_open()) {
-            std::cerr << "Failed to open wal_log.txt" << std::endl;
+        struct stat st;
+        if (fstat(standby_fd, &st) != 0) {
+            std::cerr << "Cannot stat the standby log file" << std::endl;
             exit(1);
         }
+        if (st.st_size == 0) {
+            std::swap(log_fd, standby_fd);
+        } else {
+            // An earlier checkpoint never finished, so the standby
+            // file still holds records it covers.  Ours join them.
+            move_log_to_standby();
+        }
         // Reset the operation after checkpoint
         operations_after_last_checkpoint = 0;
+        return lsn;
+    }
+
+    // The checkpoint is published, so the records it covers can go.
+    void finish_checkpoint() {
+        std::lock_guard<std::mutex> commit_lock(commit_mutex);
+        if (ftruncate(standby_fd, 0) != 0 || fsync(standby_fd) != 0) {
+            std::cerr << "Failed to truncate the standby log file" << std::endl;
+            exit(1);
+        }
     }
 
 
 private:
     // Flush the log file to disk
     void persist() {
-        std::cerr << "Persisting log to disk..." << std::endl;
-        if (!log_stream.is_open() || log_stream.bad()) {
+        std::lock_guard<std::mutex> commit_lock(commit_mutex);
+        commit_group();
+    }
+
+    // Write out the current group and make it durable.  Appends can
+    // continue into the next group while this one is being synced.
+    // Requires commit_mutex.
+    void commit_group() {
+        std::string group;
+        uint64_t group_lsn;
+        {
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            if (buffer.empty())
+                return;
+            group.swap(buffer);
+            group_lsn = lsn;
+            log_count = 0;  // Reset count after persisting
+        }
+
+        debug(std::cerr << "Persisting log to disk up to LSN " << group_lsn << std::endl);
+        const char *p = group.data();
+        size_t remaining = group.size();
+        while (remaining > 0) {
+            ssize_t written = write(log_fd, p, remaining);
+            if (written < 0) {
+                std::cerr << "Cannot persist" << std::endl;
+                exit(1);
+            }
+            p += written;
+            remaining -= written;
+        }
+        if (fdatasync(log_fd) != 0) {
             std::cerr << "Cannot persist" << std::endl;
-            return;
+            exit(1);
+        }
+        durable_lsn = group_lsn;
+    }
+
+    // Append the current file to the standby file and empty it.
+    // Requires commit_mutex.
+    void move_log_to_standby() {
+        std::vector<char> buf(1 << 20);
+        off_t offset = 0;
+        ssize_t n;
+        while ((n = pread(log_fd, buf.data(), buf.size(), offset)) > 0) {
+            for (ssize_t done = 0; done < n; ) {
+                ssize_t written = write(standby_fd, buf.data() + done, n - done);
+                if (written < 0) {
+                    std::cerr << "Cannot persist" << std::endl;
+                    exit(1);
+                }
+                done += written;
+            }
+            offset += n;
+        }
+        if (n < 0 || fdatasync(standby_fd) != 0 ||
+            ftruncate(log_fd, 0) != 0 || fsync(log_fd) != 0) {
+            std::cerr << "Failed to move the log to the standby file" << std::endl;
+            exit(1);
+        }
+    }
+
+    // Enforces the time-based group limit.
+    void group_timer_loop() {
+        std::chrono::microseconds interval(group_commit_interval);
+        std::unique_lock<std::mutex> lock(buffer_mutex);
+        while (!stopping) {
+            timer_cv.wait_for(lock, interval);
+            if (log_count > 0 && std::chrono::steady_clock::now() - group_start >= interval) {
+                lock.unlock();
+                persist();
+                lock.lock();
+            }
         }
-        log_stream.flush();
-        log_count = 0;  // Reset count after persisting
-        std::cerr << "Persisted successfully" << std::endl;
     }
 
     backing_store* storage;
-    std::ofstream log_stream;
+    int log_fd;        // Where new records go
+    int standby_fd;    // Records of an unpublished checkpoint, or empty
+    std::string buffer;
     uint64_t persistence_granularity;
     uint64_t log_count;
     uint64_t lsn;
+    std::atomic<uint64_t> durable_lsn;
     uint64_t checkpoint_granularity;
     uint64_t operations_after_last_checkpoint;
+
+    uint64_t group_commit_interval;
+    std::chrono::steady_clock::time_point group_start;
+    std::thread group_timer;
+    std::condition_variable timer_cv;
+    bool stopping;
+
+    // buffer_mutex protects the group being filled; commit_mutex
+    // serializes writers of the log file.
+    std::mutex buffer_mutex;
+    std::mutex commit_mutex;
 };
 
 #endif // LOGGER_HPP
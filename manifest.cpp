@@ -0,0 +1,281 @@
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include "manifest.hpp"
+#include "encoding.hpp"
+#include "crc32c.hpp"
+
+#define MANIFEST_SLOT_BODY_SIZE (4 + 5 * 8)
+#define MANIFEST_ENTRY_HEADER_SIZE (8)
+#define MANIFEST_PAIR_SIZE (16)
+
+static void write_all_at(int fd, const char *buf, size_t length, off_t offset, const std::string &name)
+{
+  while (length > 0) {
+    ssize_t n = pwrite(fd, buf, length, offset);
+    if (n <= 0) {
+      perror(("Couldn't write " + name).c_str());
+      exit(1);
+    }
+    buf += n;
+    length -= n;
+    offset += n;
+  }
+}
+
+static void sync_directory(void)
+{
+  int dir_fd = open(".", O_RDONLY | O_DIRECTORY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+}
+
+manifest::manifest(void)
+  : superblock_fd(-1),
+    log_fd(-1),
+    current(),
+    have_current(false),
+    min_compact_bytes(MANIFEST_MIN_COMPACT_BYTES)
+{
+}
+
+manifest::~manifest(void)
+{
+  if (superblock_fd >= 0)
+    close(superblock_fd);
+  if (log_fd >= 0)
+    close(log_fd);
+}
+
+std::string manifest::log_filename(uint64_t generation)
+{
+  return MANIFEST_LOG_FILENAME_PREFIX + std::to_string(generation);
+}
+
+void manifest::encode_entry(std::string &dst, const std::unordered_map<uint64_t, uint64_t> &versions)
+{
+  size_t start = dst.size();
+  put_fixed32(dst, 0);  // crc, filled in below
+  put_fixed32(dst, versions.size());
+  for (auto &v : versions) {
+    put_fixed64(dst, v.first);
+    put_fixed64(dst, v.second);
+  }
+  encode_fixed32(&dst[start], crc32c(dst.data() + start + 4, dst.size() - start - 4));
+}
+
+// The newest slot with a good checksum, if any.
+bool manifest::read_superblock(superblock &sb)
+{
+  bool found = false;
+  for (int slot = 0; slot < 2; slot++) {
+    char buf[4 + MANIFEST_SLOT_BODY_SIZE];
+    if (pread(superblock_fd, buf, sizeof(buf), slot * MANIFEST_SLOT_SIZE) != (ssize_t)sizeof(buf))
+      continue;
+    if (decode_fixed32(buf) != crc32c(buf + 4, MANIFEST_SLOT_BODY_SIZE) ||
+        decode_fixed32(buf + 4) != MANIFEST_MAGIC)
+      continue;
+    superblock s;
+    s.sequence = decode_fixed64(buf + 8);
+    s.generation = decode_fixed64(buf + 16);
+    s.log_length = decode_fixed64(buf + 24);
+    s.lsn = decode_fixed64(buf + 32);
+    s.root = decode_fixed64(buf + 40);
+    if (!found || s.sequence > sb.sequence) {
+      sb = s;
+      found = true;
+    }
+  }
+  return found;
+}
+
+// Slots alternate, so the previous superblock survives a torn write
+// of this one.
+void manifest::write_superblock(const superblock &sb)
+{
+  std::string buf;
+  put_fixed32(buf, 0);
+  put_fixed32(buf, MANIFEST_MAGIC);
+  put_fixed64(buf, sb.sequence);
+  put_fixed64(buf, sb.generation);
+  put_fixed64(buf, sb.log_length);
+  put_fixed64(buf, sb.lsn);
+  put_fixed64(buf, sb.root);
+  encode_fixed32(&buf[0], crc32c(buf.data() + 4, buf.size() - 4));
+  write_all_at(superblock_fd, buf.data(), buf.size(), (sb.sequence % 2) * MANIFEST_SLOT_SIZE,
+               MANIFEST_SUPERBLOCK_FILENAME);
+  if (fdatasync(superblock_fd) != 0) {
+    perror("Couldn't sync " MANIFEST_SUPERBLOCK_FILENAME);
+    exit(1);
+  }
+}
+
+bool manifest::load(uint64_t &lsn, uint64_t &root, std::unordered_map<uint64_t, uint64_t> &versions)
+{
+  superblock_fd = open(MANIFEST_SUPERBLOCK_FILENAME, O_RDWR);
+  if (superblock_fd < 0) {
+    std::cerr << "No master record on disk" << std::endl;
+    return false;
+  }
+  if (!read_superblock(current)) {
+    std::cerr << "No valid superblock in " MANIFEST_SUPERBLOCK_FILENAME << std::endl;
+    close(superblock_fd);
+    superblock_fd = -1;
+    return false;
+  }
+
+  std::string name = log_filename(current.generation);
+  log_fd = open(name.c_str(), O_RDWR);
+  if (log_fd < 0) {
+    perror(("Couldn't open " + name).c_str());
+    exit(1);
+  }
+  std::vector<char> buf(current.log_length);
+  uint64_t done = 0;
+  while (done < buf.size()) {
+    ssize_t n = pread(log_fd, buf.data() + done, buf.size() - done, done);
+    if (n <= 0) {
+      std::cerr << name << " is shorter than its superblock says" << std::endl;
+      exit(1);
+    }
+    done += n;
+  }
+
+  published.clear();
+  for (uint64_t pos = 0; pos < buf.size(); ) {
+    if (buf.size() - pos < MANIFEST_ENTRY_HEADER_SIZE) {
+      std::cerr << "Corrupt entry in " << name << " at " << pos << std::endl;
+      exit(1);
+    }
+    uint64_t count = decode_fixed32(&buf[pos + 4]);
+    uint64_t length = MANIFEST_ENTRY_HEADER_SIZE + count * MANIFEST_PAIR_SIZE;
+    if (buf.size() - pos < length ||
+        decode_fixed32(&buf[pos]) != crc32c(&buf[pos + 4], length - 4)) {
+      std::cerr << "Corrupt entry in " << name << " at " << pos << std::endl;
+      exit(1);
+    }
+    for (uint64_t i = 0; i < count; i++) {
+      const char *pair = &buf[pos + MANIFEST_ENTRY_HEADER_SIZE + i * MANIFEST_PAIR_SIZE];
+      uint64_t id = decode_fixed64(pair);
+      uint64_t version = decode_fixed64(pair + 8);
+      if (version == 0)
+        published.erase(id);
+      else
+        published[id] = version;
+    }
+    pos += length;
+  }
+
+  // Left over from a compaction that got as far as switching.
+  if (current.generation > 1)
+    unlink(log_filename(current.generation - 1).c_str());
+
+  have_current = true;
+  lsn = current.lsn;
+  root = current.root;
+  versions = published;
+  return true;
+}
+
+void manifest::publish(uint64_t lsn, uint64_t root, const std::unordered_map<uint64_t, uint64_t> &versions)
+{
+  std::unordered_map<uint64_t, uint64_t> changes;
+  for (auto &v : versions) {
+    auto it = published.find(v.first);
+    if (it == published.end() || it->second != v.second)
+      changes[v.first] = v.second;
+  }
+  for (auto &p : published)
+    if (versions.count(p.first) == 0)
+      changes[p.first] = 0;
+
+  uint64_t entry_length = MANIFEST_ENTRY_HEADER_SIZE + changes.size() * MANIFEST_PAIR_SIZE;
+  uint64_t full_length = MANIFEST_ENTRY_HEADER_SIZE + versions.size() * MANIFEST_PAIR_SIZE;
+  uint64_t new_length = current.log_length + entry_length;
+  current.lsn = lsn;
+  current.root = root;
+  if (!have_current ||
+      (new_length > MANIFEST_COMPACT_RATIO * full_length && new_length > min_compact_bytes)) {
+    compact(versions);
+  } else {
+    if (!changes.empty()) {
+      std::string entry;
+      encode_entry(entry, changes);
+      write_log(entry);
+    }
+    current.sequence++;
+    write_superblock(current);
+  }
+  published = versions;
+}
+
+void manifest::get(uint64_t &lsn, uint64_t &root, std::unordered_map<uint64_t, uint64_t> &versions) const
+{
+  lsn = current.lsn;
+  root = current.root;
+  versions = published;
+}
+
+// Append entry to the log where the superblock says it ends.  Anything
+// past that point was never published.
+void manifest::write_log(const std::string &entry)
+{
+  std::string name = log_filename(current.generation);
+  write_all_at(log_fd, entry.data(), entry.size(), current.log_length, name);
+  if (fdatasync(log_fd) != 0) {
+    perror(("Couldn't sync " + name).c_str());
+    exit(1);
+  }
+  current.log_length += entry.size();
+}
+
+// Start a new generation of the log holding just versions.
+void manifest::compact(const std::unordered_map<uint64_t, uint64_t> &versions)
+{
+  uint64_t generation = have_current ? current.generation + 1 : 1;
+  std::string name = log_filename(generation);
+  std::string tmp_name = name + ".tmp";
+  std::string entry;
+  encode_entry(entry, versions);
+
+  int fd = open(tmp_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(("Couldn't open " + tmp_name).c_str());
+    exit(1);
+  }
+  write_all_at(fd, entry.data(), entry.size(), 0, tmp_name);
+  if (fsync(fd) != 0) {
+    perror(("Couldn't sync " + tmp_name).c_str());
+    exit(1);
+  }
+  if (rename(tmp_name.c_str(), name.c_str()) != 0) {
+    perror(("Couldn't rename " + tmp_name).c_str());
+    exit(1);
+  }
+  if (superblock_fd < 0) {
+    superblock_fd = open(MANIFEST_SUPERBLOCK_FILENAME, O_RDWR | O_CREAT, 0644);
+    if (superblock_fd < 0) {
+      perror("Couldn't open " MANIFEST_SUPERBLOCK_FILENAME);
+      exit(1);
+    }
+  }
+  sync_directory();
+
+  uint64_t old_generation = current.generation;
+  current.generation = generation;
+  current.log_length = entry.size();
+  current.sequence++;
+  write_superblock(current);
+
+  if (log_fd >= 0)
+    close(log_fd);
+  log_fd = fd;
+  if (have_current)
+    unlink(log_filename(old_generation).c_str());
+  have_current = true;
+}
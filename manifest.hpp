@@ -0,0 +1,101 @@
+// The master record: which version of each object, which root and
+// which LSN make up the last published checkpoint.
+
+// Most objects do not change between two checkpoints, so the record
+// is kept as a log of changes rather than rewritten in full.  Each
+// checkpoint appends one entry listing the objects whose version
+// changed since the previous one (version 0: the object is gone).  The
+// log lives in a file of its own, laid out as
+//
+//   entry:
+//     u32 crc32c     of everything after this field
+//     u32 count      of pairs
+//     count * (u64 object id, u64 version)
+//
+// Appends are only ever made at the end of the part that a
+// superblock vouches for, and become part of the record once a
+// superblock says so.  The superblock file holds two slots, written in
+// turn so that a torn write leaves the other one intact:
+//
+//   slot (at 0 or MANIFEST_SLOT_SIZE):
+//     u32 crc32c     of the rest of the slot
+//     u32 magic
+//     u64 sequence   higher is newer
+//     u64 generation of the log file
+//     u64 log length in bytes
+//     u64 checkpoint LSN
+//     u64 root object id
+//
+// When the log has grown well past the size of a single entry naming
+// every object, it is compacted: that single entry goes into a log
+// file of the next generation, written under a temporary name and
+// renamed into place, and the superblock then switches to it.
+
+// All integers are little-endian.  Files live in the current
+// directory, next to the write-ahead log.
+
+#ifndef MANIFEST_HPP
+#define MANIFEST_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#define MANIFEST_SUPERBLOCK_FILENAME "manifest_superblock"
+#define MANIFEST_LOG_FILENAME_PREFIX "manifest_log_"
+
+#define MANIFEST_SLOT_SIZE (512)
+#define MANIFEST_MAGIC (0x5346494dU)  // "MIFS"
+
+// Compact once the log is this many times the size of a full entry
+// (and at least MANIFEST_MIN_COMPACT_BYTES, unless
+// set_min_compact_bytes() says otherwise).
+#define MANIFEST_COMPACT_RATIO (4)
+#define MANIFEST_MIN_COMPACT_BYTES (1 << 20)
+
+class manifest {
+public:
+  manifest(void);
+  ~manifest(void);
+
+  // Read the last published record.  Returns false if there is none.
+  bool load(uint64_t &lsn, uint64_t &root, std::unordered_map<uint64_t, uint64_t> &versions);
+
+  // Durably make versions (object id -> version) the record.  Every
+  // object version it names must already be on disk.
+  void publish(uint64_t lsn, uint64_t root, const std::unordered_map<uint64_t, uint64_t> &versions);
+
+  // Whether there is a record, loaded or published, and what it says.
+  bool is_published(void) const { return have_current; }
+  void get(uint64_t &lsn, uint64_t &root, std::unordered_map<uint64_t, uint64_t> &versions) const;
+
+  // A small tree never grows its log to MANIFEST_MIN_COMPACT_BYTES; a
+  // lower threshold makes it compact, e.g. to test compaction.
+  void set_min_compact_bytes(uint64_t bytes) { min_compact_bytes = bytes; }
+
+private:
+  struct superblock {
+    uint64_t sequence;
+    uint64_t generation;
+    uint64_t log_length;
+    uint64_t lsn;
+    uint64_t root;
+  };
+
+  static std::string log_filename(uint64_t generation);
+  static void encode_entry(std::string &dst, const std::unordered_map<uint64_t, uint64_t> &versions);
+  bool read_superblock(superblock &sb);
+  void write_superblock(const superblock &sb);
+  void write_log(const std::string &entry);
+  void compact(const std::unordered_map<uint64_t, uint64_t> &versions);
+
+  int superblock_fd;
+  int log_fd;
+  superblock current;
+  bool have_current;
+  uint64_t min_compact_bytes;
+  // The record as of current
+  std::unordered_map<uint64_t, uint64_t> published;
+};
+
+#endif // MANIFEST_HPP
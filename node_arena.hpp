@@ -0,0 +1,153 @@
+// Per-node memory arenas.
+
+// A node_arena hands out small blocks carved from a few large chunks
+// that it owns.  A freed block goes on a free list for its size and
+// is reused by the next allocation of that size, so a node whose
+// buffer churns (messages in from the parent, out to the children)
+// settles into its chunks and stops calling malloc.  Destroying the
+// arena releases every chunk at once, so evicting or freeing a node
+// costs a handful of free() calls however many entries it held.
+
+// arena_allocator<T> is a standard allocator on top of a node_arena,
+// for the containers that live inside a node.  An allocator with no
+// arena uses the heap, so temporary maps built outside any node work
+// as usual.  Copying a container does not copy its arena with it:
+// the copy uses the heap, since it may well outlive the node.
+
+// An arena is not thread-safe.  It belongs to one node and is only
+// touched by whoever may modify that node.
+
+#ifndef NODE_ARENA_HPP
+#define NODE_ARENA_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <memory>
+#include <vector>
+
+#define NODE_ARENA_FIRST_CHUNK (4096)
+#define NODE_ARENA_MAX_CHUNK   (1 << 20)
+// Larger blocks go straight to the heap.
+#define NODE_ARENA_MAX_BLOCK   (1024)
+
+class node_arena {
+public:
+  node_arena(void) {}
+  node_arena(const node_arena &) = delete;
+  node_arena &operator=(const node_arena &) = delete;
+
+  ~node_arena(void) {
+    for (auto chunk : chunks)
+      ::operator delete(chunk);
+  }
+
+  void *allocate(size_t bytes) {
+    if (bytes > NODE_ARENA_MAX_BLOCK)
+      return ::operator new(bytes);
+    size_t cls = size_class(bytes);
+    if (cls < free_lists.size() && free_lists[cls]) {
+      free_block *b = free_lists[cls];
+      free_lists[cls] = b->next;
+      return b;
+    }
+    size_t rounded = cls * ALIGNMENT;
+    if ((size_t)(chunk_end - next_free) < rounded)
+      new_chunk();
+    void *p = next_free;
+    next_free += rounded;
+    return p;
+  }
+
+  void deallocate(void *p, size_t bytes) {
+    if (bytes > NODE_ARENA_MAX_BLOCK) {
+      ::operator delete(p);
+      return;
+    }
+    size_t cls = size_class(bytes);
+    if (cls >= free_lists.size())
+      free_lists.resize(cls + 1, nullptr);
+    free_block *b = (free_block *)p;
+    b->next = free_lists[cls];
+    free_lists[cls] = b;
+  }
+
+  // Bytes held in chunks, used or not.
+  size_t bytes_reserved(void) const {
+    return reserved;
+  }
+
+private:
+  struct free_block {
+    free_block *next;
+  };
+
+  static const size_t ALIGNMENT = alignof(std::max_align_t);
+
+  static size_t size_class(size_t bytes) {
+    if (bytes < sizeof(free_block))
+      bytes = sizeof(free_block);
+    return (bytes + ALIGNMENT - 1) / ALIGNMENT;
+  }
+
+  // The tail of the current chunk is abandoned; chunks double in
+  // size so a big node needs only a few of them.
+  void new_chunk(void) {
+    char *chunk = (char *)::operator new(next_chunk_size);
+    chunks.push_back(chunk);
+    reserved += next_chunk_size;
+    next_free = chunk;
+    chunk_end = chunk + next_chunk_size;
+    if (next_chunk_size < NODE_ARENA_MAX_CHUNK)
+      next_chunk_size *= 2;
+  }
+
+  std::vector<char *> chunks;
+  char *next_free = nullptr;
+  char *chunk_end = nullptr;
+  size_t next_chunk_size = NODE_ARENA_FIRST_CHUNK;
+  size_t reserved = 0;
+  std::vector<free_block *> free_lists;  // Indexed by size class
+};
+
+template <class T>
+class arena_allocator {
+public:
+  typedef T value_type;
+
+  arena_allocator(node_arena *arena = nullptr) : arena(arena) {}
+
+  template <class U>
+  arena_allocator(const arena_allocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t n) {
+    if (arena)
+      return (T *)arena->allocate(n * sizeof(T));
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T *p, size_t n) {
+    if (arena)
+      arena->deallocate(p, n * sizeof(T));
+    else
+      std::allocator<T>().deallocate(p, n);
+  }
+
+  arena_allocator select_on_container_copy_construction(void) const {
+    return arena_allocator();
+  }
+
+  node_arena *arena;
+};
+
+template <class T, class U>
+bool operator==(const arena_allocator<T> &a, const arena_allocator<U> &b) {
+  return a.arena == b.arena;
+}
+
+template <class T, class U>
+bool operator!=(const arena_allocator<T> &a, const arena_allocator<U> &b) {
+  return a.arena != b.arena;
+}
+
+#endif // NODE_ARENA_HPP
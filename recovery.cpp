@@ -5,100 +5,147 @@
 #include <vector>
 #include <bits/stdc++.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "recovery.hpp"
 #include "betree.hpp"
+#include "wal_format.hpp"
 #include "debug.hpp"
-Recovery::Recovery(swap_space *sspace_ptr, betree<uint64_t, std::string> *tree) : sspace_ptr(sspace_ptr), tree(tree)
+
+// Replay reads the log this many bytes at a time.
+#define REPLAY_READ_SIZE (1 << 20)
+
+Recovery::Recovery(swap_space *sspace_ptr, redo_function redo) : sspace_ptr(sspace_ptr),
+                                                                  redo(redo),
+                                                                  checkpoint_lsn(0),
+                                                                  last_lsn(0)
 {
 }
 
-void Recovery::do_recovery()
+bool Recovery::restore_checkpoint()
 {
-
-    // if (!logger->log_exists()) {
-    // std::cout << "No log file found. starting with an empty tree." << std::endl;
-    // return;
-    // }
     std::cout << "Starting Recovery...\n";
-    
-    sspace_ptr->parse_master_log();
 
-    sspace_ptr->rebuild_tree();
+    if (!sspace_ptr->rebuild_tree())
+        return false;
 
-    uint64_t last_checkpoint_lsn = read_master_record();
-
-    replay_log(last_checkpoint_lsn);
-
-    std::cout << "Recovery completed successfully" << std::endl;
+    checkpoint_lsn = sspace_ptr->get_checkpoint_lsn();
+    last_lsn = checkpoint_lsn;
+    return true;
 }
 
-uint64_t Recovery::read_master_record()
+uint64_t Recovery::get_checkpoint_lsn() const
 {
+    return checkpoint_lsn;
+}
 
-    std::ifstream master_record("master_record.txt");
-
-    if (!master_record.is_open())
-    {
-        std::cerr << "Assuming no checkpoint exists.\n";
-        return 0;
-    }
-
-    uint64_t lsn = 0;
-    master_record >> lsn;
-    master_record.close();
-    return lsn;
+uint64_t Recovery::get_last_lsn() const
+{
+    return last_lsn;
 }
 
-void Recovery::replay_log(uint64_t last_checkpoint_lsn)
+// The log is split over two files (see logger.hpp); the one holding
+// older records is replayed first.
+void Recovery::replay_log()
 {
     std::cout << "Replaying Logs...\n";
-
-    std::ifstream log_stream("wal_log.txt");
-    if (!log_stream.is_open())
-    {
+    std::cout << "Replying LSN " << checkpoint_lsn << std::endl;
+
+    const char *files[2] = {WAL_FILENAME, WAL_ALT_FILENAME};
+    uint64_t first_lsn[2] = {UINT64_MAX, UINT64_MAX};
+    for (int i = 0; i < 2; i++)
+        read_first_wal_lsn(files[i], first_lsn[i]);
+    if (first_lsn[1] < first_lsn[0])
+        std::swap(files[0], files[1]);
+
+    bool opened = false;
+    for (int i = 0; i < 2; i++)
+        opened |= replay_file(files[i]);
+    if (!opened)
         std::cerr << "Couldn't open WAL log file for recovery.\n";
-        return;
-    }
 
-    std::string line;
-
-    std::cout << "Replying LSN " << last_checkpoint_lsn << std::endl;
+    std::cout << "Recovery completed successfully" << std::endl;
+}
 
-    while (std::getline(log_stream, line))
+// The log is read in large sequential chunks and decoded in place.
+// A record split across two chunks is moved to the front of the
+// buffer before the next read.  The first torn or corrupt record ends
+// the file; it is cut off so that new records are not appended after
+// garbage.  Records at or below last_lsn are already reflected in the
+// tree and are skipped.
+bool Recovery::replay_file(const char *path)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+        return false;
+
+    std::vector<char> buf(REPLAY_READ_SIZE);
+    size_t filled = 0;       // Bytes in buf
+    size_t pos = 0;          // Start of the next record in buf
+    off_t buf_offset = 0;    // File offset of buf[0]
+    bool eof = false;
+    bool corrupt = false;
+    std::string value;
+
+    while (!corrupt)
     {
-        std::istringstream iss(line);
-        uint64_t lsn;
-        iss >> lsn;
+        wal_record rec;
+        size_t consumed;
+        wal_decode_status status = decode_wal_record(buf.data() + pos, filled - pos, rec, &consumed);
 
-        if (lsn <= last_checkpoint_lsn)
+        if (status == WAL_RECORD_INCOMPLETE)
+        {
+            if (eof)
+                break;
+            // Slide the partial record down and refill behind it.
+            memmove(buf.data(), buf.data() + pos, filled - pos);
+            buf_offset += pos;
+            filled -= pos;
+            pos = 0;
+            if (buf.size() - filled < REPLAY_READ_SIZE / 2)
+                buf.resize(filled + REPLAY_READ_SIZE);
+            ssize_t n = read(fd, buf.data() + filled, buf.size() - filled);
+            if (n < 0)
+            {
+                std::cerr << "Error reading WAL log file.\n";
+                close(fd);
+                exit(1);
+            }
+            if (n == 0)
+                eof = true;
+            filled += n;
             continue;
+        }
 
-        std::string operation;
-        int key;
-        std::string value;
+        if (status == WAL_RECORD_CORRUPT)
+        {
+            corrupt = true;
+            break;
+        }
 
-        iss >> operation >> key;
+        pos += consumed;
+        if (rec.lsn <= last_lsn)
+            continue;
+        last_lsn = rec.lsn;
 
-        iss >> value;
-        value.erase(std::remove(value.begin(), value.end(), ':'), value.end());
+        value.assign(rec.value, rec.value_length);
+        debug(std::cout << "Replaying " << rec.opcode << " key " << rec.key << " value " << value << std::endl);
+        redo(rec.lsn, rec.opcode, rec.key, value);
+    }
 
-        debug(std::cout << "OPERATION" << operation << "key " << key << "value " << value << std::endl);
-        if (operation == "INSERT")
-        {
-            debug(std::cout << "Replying Insert " << key << " value " << value << std::endl);
-            tree->insert(key, value);
-        }
-        else if (operation == "DELETE")
-        {
-            debug(std::cout << "Replying Delete " << key << std::endl);
-            tree->erase(key);
-        }
-        else if (operation == "UPDATE")
+    off_t valid_length = buf_offset + pos;
+    if (corrupt || pos < filled)
+    {
+        std::cerr << "Discarding torn WAL tail at offset " << valid_length << std::endl;
+        if (ftruncate(fd, valid_length) != 0 || fsync(fd) != 0)
         {
-            debug(std::cout << "Replying Update " << key << " value " << value << std::endl);
-            tree->update(key, value);
+            std::cerr << "Failed to truncate " << path << std::endl;
+            close(fd);
+            exit(1);
         }
     }
 
-    log_stream.close();
+    close(fd);
+    return true;
 }
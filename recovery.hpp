@@ -5,21 +5,40 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <functional>
 #include "swap_space.hpp" 
 
-template <class Key, class Value>
-class betree;
-
 class Recovery {
 public:
-    Recovery(swap_space* sspace_ptr, betree<uint64_t, std::string>* tree);
-    void do_recovery();
+    // Re-executes one logged operation against the tree.  This keeps
+    // Recovery independent of the betree's template parameters.  The
+    // operation must not be logged again.
+    typedef std::function<void(uint64_t lsn, int opcode, uint64_t key, const std::string &value)> redo_function;
+
+    Recovery(swap_space* sspace_ptr, redo_function redo);
+
+    // Recovery happens in two steps, so that the tree can attach to
+    // its restored root before the log is replayed on top of it.
+
+    // Rebuild the swap space from the last checkpoint.  Returns false
+    // if there is no checkpoint.
+    bool restore_checkpoint();
+
+    // Redo every logged operation newer than the checkpoint.
+    void replay_log();
+
+    uint64_t get_checkpoint_lsn() const;
+
+    // The LSN of the last operation recovered, whether from the
+    // checkpoint or from the log.
+    uint64_t get_last_lsn() const;
 
 private:
     swap_space* sspace_ptr;
-    betree<uint64_t, std::string>* tree;
-    uint64_t read_master_record();
-    void replay_log(uint64_t last_checkpoint_lsn);
+    redo_function redo;
+    uint64_t checkpoint_lsn;
+    uint64_t last_lsn;
+    bool replay_file(const char *path);
 };
 
 #endif 
@@ -0,0 +1,80 @@
+// A reader-writer lock that does not let readers starve a writer.
+
+// std::shared_mutex leaves the policy open, and glibc's lets new
+// readers in for as long as any reader holds the lock, so a steady
+// stream of queries keeps an upsert waiting forever.  Here a writer
+// that is waiting closes a turnstile that arriving readers have to
+// pass, so the readers already inside drain and the writer gets in.
+
+// A thread that already holds the lock shared may take it shared
+// again (say, query the tree while it holds an iterator) without
+// going through the turnstile: the writer is waiting for that thread,
+// so making it wait for the writer would deadlock.  This means a
+// shared hold belongs to the thread that took it and has to be
+// released by that thread.
+
+// Meets the SharedMutex requirements, so std::shared_lock and
+// std::unique_lock work with it.
+
+#ifndef RWLOCK_HPP
+#define RWLOCK_HPP
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include <utility>
+
+class rwlock {
+public:
+  void lock(void) {
+    writers_waiting++;
+    turnstile.lock();
+    mutex.lock();
+  }
+
+  void unlock(void) {
+    mutex.unlock();
+    turnstile.unlock();
+    writers_waiting--;
+  }
+
+  void lock_shared(void) {
+    auto &held = shared_holds();
+    for (auto &h : held)
+      if (h.first == this) {
+        h.second++;
+        return;
+      }
+    if (writers_waiting.load() > 0) {
+      std::lock_guard<std::mutex> wait(turnstile);
+    }
+    mutex.lock_shared();
+    held.emplace_back(this, 1);
+  }
+
+  void unlock_shared(void) {
+    auto &held = shared_holds();
+    for (auto it = held.begin(); it != held.end(); ++it)
+      if (it->first == this) {
+        if (--it->second == 0) {
+          held.erase(it);
+          mutex.unlock_shared();
+        }
+        return;
+      }
+  }
+
+private:
+  // The rwlocks this thread holds shared, and how many times.
+  static std::vector<std::pair<const rwlock *, int>> &shared_holds(void) {
+    thread_local std::vector<std::pair<const rwlock *, int>> held;
+    return held;
+  }
+
+  std::atomic<int> writers_waiting{0};
+  std::mutex turnstile;  // Held by the writer from before it waits
+  std::shared_mutex mutex;
+};
+
+#endif // RWLOCK_HPP
@@ -3,67 +3,322 @@
 #include <iostream>
 #include <string>
 #include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <iterator>
+#include <algorithm>
+#include <zlib.h>
 #include "swap_space.hpp"
+#include "encoding.hpp"
+#include "crc32c.hpp"
 
 // Methods to serialize/deserialize different kinds of objects.
 // You shouldn't need to touch these.
 void serialize(std::iostream &fs, serialization_context &context, uint64_t x)
 {
-  fs << x << " ";
+  if (context.format == NODE_FORMAT_TEXT)
+  {
+    fs << x << " ";
+  }
+  else
+  {
+    char buf[8];
+    encode_fixed64(buf, x);
+    fs.write(buf, sizeof(buf));
+  }
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, uint64_t &x)
 {
-  fs >> x;
+  if (context.format == NODE_FORMAT_TEXT)
+  {
+    fs >> x;
+  }
+  else
+  {
+    char buf[8];
+    fs.read(buf, sizeof(buf));
+    x = decode_fixed64(buf);
+  }
   assert(fs.good());
 }
 
 void serialize(std::iostream &fs, serialization_context &context, int64_t x)
 {
-  fs << x << " ";
+  if (context.format == NODE_FORMAT_TEXT)
+    fs << x << " ";
+  else
+    serialize(fs, context, (uint64_t)x);
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, int64_t &x)
 {
-  fs >> x;
+  if (context.format == NODE_FORMAT_TEXT)
+  {
+    fs >> x;
+  }
+  else
+  {
+    uint64_t u;
+    deserialize(fs, context, u);
+    x = (int64_t)u;
+  }
   assert(fs.good());
 }
 
-void serialize(std::iostream &fs, serialization_context &context, std::string x)
+void serialize(std::iostream &fs, serialization_context &context, uint8_t x)
 {
-  fs << x.size() << ",";
+  if (context.format == NODE_FORMAT_TEXT)
+    fs << (unsigned int)x << " ";
+  else
+    fs.put((char)x);
   assert(fs.good());
-  fs.write(x.data(), x.size());
+}
+
+void deserialize(std::iostream &fs, serialization_context &context, uint8_t &x)
+{
+  if (context.format == NODE_FORMAT_TEXT)
+  {
+    unsigned int u;
+    fs >> u;
+    x = (uint8_t)u;
+  }
+  else
+  {
+    x = (uint8_t)fs.get();
+  }
   assert(fs.good());
 }
 
-void deserialize(std::iostream &fs, serialization_context &context, std::string &x)
+void serialize(std::iostream &fs, serialization_context &context, const std::string &x)
 {
-  size_t length;
-  char comma;
-  fs >> length >> comma;
+  if (context.format == NODE_FORMAT_TEXT)
+  {
+    fs << x.size() << ",";
+  }
+  else
+  {
+    char buf[4];
+    encode_fixed32(buf, x.size());
+    fs.write(buf, sizeof(buf));
+  }
   assert(fs.good());
-  char *buf = new char[length];
-  assert(buf);
-  fs.read(buf, length);
+  fs.write(x.data(), x.size());
   assert(fs.good());
-  x = std::string(buf, length);
-  delete buf;
 }
 
-bool swap_space::cmp_by_last_access(swap_space::object *a, swap_space::object *b)
+void deserialize(std::iostream &fs, serialization_context &context, std::string &x)
+{
+  if (context.format == NODE_FORMAT_TEXT)
+  {
+    size_t length;
+    char comma;
+    fs >> length >> comma;
+    assert(fs.good());
+    x.resize(length);
+    fs.read(&x[0], length);
+    assert(fs.good());
+  }
+  else
+  {
+    char buf[4];
+    fs.read(buf, sizeof(buf));
+    assert(fs.good());
+    x.resize(decode_fixed32(buf));
+    fs.read(&x[0], x.size());
+    assert(fs.good());
+  }
+}
+
+void serialize_text(std::iostream &fs, serialization_context &context, const char *text)
+{
+  if (context.format == NODE_FORMAT_TEXT)
+    fs << text;
+}
+
+void deserialize_text(std::iostream &fs, serialization_context &context, const char *expected)
+{
+  if (context.format == NODE_FORMAT_TEXT)
+  {
+    std::string dummy;
+    fs >> dummy;
+    assert(expected == NULL || dummy == expected);
+  }
+}
+
+// Layout of the header in front of every stored object:
+//   0  magic "BeTN"
+//   4  header version (16 bits)
+//   6  node_format (8 bits)
+//   7  flags (8 bits)
+//   8  payload length (64 bits)
+//  16  CRC-32C of the payload (32 bits)
+//  20  reserved, zero (32 bits)
+// All integers are little-endian.
+#define OBJECT_HEADER_MAGIC "BeTN"
+#define OBJECT_HEADER_VERSION (1)
+#define OBJECT_HEADER_SIZE (24)
+#define OBJECT_HEADER_FLAG_LEAF (0x1)
+
+static std::string encode_object_header(node_format fmt, bool is_leaf, const std::string &payload)
+{
+  char buf[OBJECT_HEADER_SIZE];
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, OBJECT_HEADER_MAGIC, 4);
+  encode_fixed16(buf + 4, OBJECT_HEADER_VERSION);
+  buf[6] = (char)fmt;
+  buf[7] = is_leaf ? OBJECT_HEADER_FLAG_LEAF : 0;
+  encode_fixed64(buf + 8, payload.size());
+  encode_fixed32(buf + 16, crc32c(payload.data(), payload.size()));
+  return std::string(buf, sizeof(buf));
+}
+
+// Images in the compressed tier are plain zlib streams.
+static std::string compress_image_bytes(const std::string &image)
+{
+  uLongf length = compressBound(image.size());
+  std::string compressed(length, '\0');
+  if (compress2((Bytef *)&compressed[0], &length, (const Bytef *)image.data(),
+                image.size(), Z_BEST_SPEED) != Z_OK)
+  {
+    std::cerr << "Failed to compress an object image" << std::endl;
+    abort();
+  }
+  compressed.resize(length);
+  return compressed;
+}
+
+static std::string uncompress_image_bytes(const std::string &compressed, uint64_t image_length)
+{
+  std::string image(image_length, '\0');
+  uLongf length = image_length;
+  if (uncompress((Bytef *)&image[0], &length, (const Bytef *)compressed.data(),
+                 compressed.size()) != Z_OK || length != image_length)
+  {
+    std::cerr << "Failed to uncompress an object image" << std::endl;
+    abort();
+  }
+  return image;
+}
+
+bool swap_space::read_object_header(std::iostream &in, object_header &hdr)
+{
+  char buf[OBJECT_HEADER_SIZE];
+  in.read(buf, sizeof(buf));
+  if (!in.good() || memcmp(buf, OBJECT_HEADER_MAGIC, 4) != 0)
+    return false;
+  if (decode_fixed16(buf + 4) != OBJECT_HEADER_VERSION)
+    return false;
+  if (buf[6] != NODE_FORMAT_BINARY && buf[6] != NODE_FORMAT_TEXT)
+    return false;
+  hdr.format = (node_format)buf[6];
+  hdr.is_leaf = buf[7] & OBJECT_HEADER_FLAG_LEAF;
+  hdr.payload_length = decode_fixed64(buf + 8);
+  hdr.checksum = decode_fixed32(buf + 16);
+  return true;
+}
+
+// Read the stored image of obj, check it, and return its payload.
+// Called without cache_mutex by the thread loading obj: nobody else
+// touches the fields we use until the load is over.
+std::string swap_space::read_object(object *obj, node_format &fmt)
+{
+  // An image in the compressed tier or still waiting to be written
+  // is read from memory.  Grab it under the lock, as other threads
+  // spill the tier and reap written images.
+  std::stringstream image;
+  std::string compressed;
+  std::shared_ptr<const std::string> pending;
+  std::shared_ptr<prefetch_slot> prefetched;
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    reap_write_backs();
+    if (obj->in_compressed_cache)
+      compressed = take_compressed_image(obj);
+    else if (obj->pending_image)
+    {
+      pending = obj->pending_image;
+    }
+    else
+    {
+      prefetched = take_prefetch(obj);
+    }
+  }
+
+  if (!compressed.empty())
+    image.str(uncompress_image_bytes(compressed, obj->image_length));
+  else if (pending)
+    image.str(*pending);
+  else if (prefetched)
+    image.str(wait_for_prefetch(prefetched));
+  else
+  {
+    std::string stored;
+    backstore->read(obj->id, obj->version, stored);
+    image.str(stored);
+  }
+
+  bool is_leaf;
+  return check_image(image, obj->id, obj->version, fmt, is_leaf);
+}
+
+// Check the header and checksum of a stored image of version of object
+// id, and return its payload.
+std::string swap_space::check_image(std::stringstream &image, uint64_t id, uint64_t version,
+                                    node_format &fmt, bool &is_leaf)
+{
+  object_header hdr;
+  if (!read_object_header(image, hdr))
+  {
+    std::cerr << "Bad header in object " << id << " version " << version << std::endl;
+    abort();
+  }
+  std::string payload(hdr.payload_length, '\0');
+  image.read(&payload[0], payload.size());
+  if (crc32c(payload.data(), payload.size()) != hdr.checksum)
+  {
+    std::cerr << "Checksum mismatch in object " << id << " version " << version << std::endl;
+    abort();
+  }
+  fmt = hdr.format;
+  is_leaf = hdr.is_leaf;
+  return payload;
+}
+
+// The version snapshot names is on the backing store for as long as
+// snapshot exists, and never changes, so no lock is needed.
+std::string swap_space::read_snapshot_image(const swap_snapshot &snapshot, uint64_t id,
+                                            node_format &fmt, bool &is_leaf)
 {
-  return a->last_access < b->last_access;
+  auto it = snapshot.versions.find(id);
+  assert(it != snapshot.versions.end());
+  std::string stored;
+  backstore->read(id, it->second, stored);
+  std::stringstream image(stored);
+  return check_image(image, id, it->second, fmt, is_leaf);
 }
 
-swap_space::swap_space(backing_store *bs, uint64_t n, uint64_t checkpoint_granularity) : backstore(bs),
+swap_space::swap_space(backing_store *bs, uint64_t n, uint64_t checkpoint_granularity) : root(0),
+                                                                                         backstore(bs),
                                                                                          max_in_memory_objects(n),
                                                                                          checkpoint_granularity(checkpoint_granularity),
-                                                                                         objects(),
-                                                                                         lru_pqueue(cmp_by_last_access)
+                                                                                         objects()
+{
+#ifdef DEBUG
+  format = NODE_FORMAT_TEXT;
+#else
+  format = NODE_FORMAT_BINARY;
+#endif
+  start_write_back_threads(DEFAULT_WRITE_BACK_THREADS);
+  start_prefetch_threads(DEFAULT_PREFETCH_THREADS);
+}
+
+swap_space::~swap_space(void)
 {
+  stop_prefetch_threads();
+  stop_write_back_threads();
 }
 
 // construct a new object. Called by ss->allocate() via pointer<Referent> construction
@@ -75,260 +330,839 @@ swap_space::object::object(swap_space *sspace, serializable *tgt)
   version = 0;
   is_leaf = false;
   refcount = 1;
-  last_access = sspace->next_access_time++;
   target_is_dirty = true;
   pincount = 0;
-  old_version = 0;
+  referenced = false;
+  loading = false;
+  checkpoint_version = 0;
+  snapshot_pending = false;
+  resident_round = 0;
+  clock_prev = NULL;
+  clock_next = NULL;
+  footprint = 0;
+  image_length = 0;
+  in_compressed_cache = false;
+  image_is_dirty = false;
+  tier_prev = NULL;
+  tier_next = NULL;
+}
+
+// Put a newly in-memory obj on the ring, just behind the hand, so it
+// is the last one the hand reaches.  It starts out referenced.
+void swap_space::clock_insert(swap_space::object *obj)
+{
+  assert(obj->clock_next == NULL);
+  obj->referenced = true;
+  if (clock_hand == NULL)
+  {
+    obj->clock_prev = obj;
+    obj->clock_next = obj;
+    clock_hand = obj;
+    return;
+  }
+  obj->clock_next = clock_hand;
+  obj->clock_prev = clock_hand->clock_prev;
+  clock_hand->clock_prev->clock_next = obj;
+  clock_hand->clock_prev = obj;
+}
+
+void swap_space::clock_remove(swap_space::object *obj)
+{
+  assert(obj->clock_next != NULL);
+  if (obj->clock_next == obj)
+  {
+    clock_hand = NULL;
+  }
+  else
+  {
+    if (clock_hand == obj)
+      clock_hand = obj->clock_next;
+    obj->clock_prev->clock_next = obj->clock_next;
+    obj->clock_next->clock_prev = obj->clock_prev;
+  }
+  obj->clock_prev = NULL;
+  obj->clock_next = NULL;
+}
+
+void swap_space::set_node_format(node_format fmt)
+{
+  format = fmt;
 }
 
 // set # of items that can live in ss.
 void swap_space::set_cache_size(uint64_t sz)
 {
   assert(sz > 0);
+  std::lock_guard<std::mutex> lock(cache_mutex);
   max_in_memory_objects = sz;
   maybe_evict_something();
 }
 
+void swap_space::set_cache_bytes(uint64_t bytes)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  max_in_memory_bytes = bytes;
+  maybe_evict_something();
+}
+
+// Re-estimate the memory used by obj's in-memory target.
+void swap_space::update_footprint(swap_space::object *obj)
+{
+  assert(obj->target != NULL);
+  current_in_memory_bytes -= obj->footprint;
+  obj->footprint = obj->target.load()->footprint();
+  current_in_memory_bytes += obj->footprint;
+}
+
+bool swap_space::over_budget(void) const
+{
+  return current_in_memory_objects > max_in_memory_objects ||
+         (max_in_memory_bytes > 0 && current_in_memory_bytes > max_in_memory_bytes);
+}
+
+// Serialize obj's in-memory target.  detach also makes the pointers
+// in it let go of their targets, which keeps refcounts right later on
+// when we delete them all.
+std::string swap_space::serialize_target(swap_space::object *obj, bool detach)
+{
+  serialization_context ctxt(*this, format);
+  ctxt.detach = detach;
+  std::stringstream sstream;
+  serialize(sstream, ctxt, *obj->target.load());
+  obj->is_leaf = ctxt.is_leaf;
+  return sstream.str();
+}
+
 // write an object that lives on disk back to disk
 // only triggers a write if the object is "dirty" (target_is_dirty == true)
-void swap_space::write_back(swap_space::object *obj)
+void swap_space::write_back(swap_space::object *obj, bool evicting)
 {
   assert(objects.count(obj->id) > 0);
 
  debug(std::cout << "Writing back " << obj->id << " " << obj->version
                   << " (" << obj->target << ") "
-                  << "with last access time " << obj->last_access << std::endl);
-
-  // This calls _serialize on all the pointers in this object,
-  // which keeps refcounts right later on when we delete them all.
-  // In the future, we may also use this to implement in-memory
-  // evictions, i.e. where we first "evict" an object by
-  // compressing it and keeping the compressed version in memory.
-  serialization_context ctxt(*this);
-  std::stringstream sstream;
-  serialize(sstream, ctxt, *obj->target);
-  obj->is_leaf = ctxt.is_leaf;
+                  << std::endl);
 
-  if (obj->target_is_dirty)
+  // Not in memory, but its newest state may be in the compressed tier.
+  if (obj->target == NULL)
   {
-    std::string buffer = sstream.str();
+    assert(obj->in_compressed_cache || !obj->image_is_dirty);
+    if (obj->image_is_dirty)
+      write_version(obj, uncompress_image_bytes(obj->compressed_image, obj->image_length));
+    return;
+  }
+
+  bool dirty = obj->target_is_dirty || obj->image_is_dirty;
+  if (!dirty && !evicting)
+    return;
 
-    // modification - ss now controls BSID - split into unique id and version.
-    // version increments linearly based uniquely on this version counter.
+  std::string payload = serialize_target(obj, evicting);
+  if (dirty)
+  {
+    write_version(obj, encode_object_header(format, obj->is_leaf, payload) + payload);
+    obj->target_is_dirty = false;
+  }
+}
 
-    uint64_t new_version_id = obj->version + 1;
+// Store image as the next version of obj.
+void swap_space::write_version(swap_space::object *obj, std::string image)
+{
+  // modification - ss now controls BSID - split into unique id and version.
+  // version increments linearly based uniquely on this version counter.
 
-    backstore->allocate(obj->id, new_version_id);
-    std::iostream *out = backstore->get(obj->id, new_version_id);
-    out->write(buffer.data(), buffer.length());
-    backstore->put(out);
+  uint64_t new_version_id = obj->version + 1;
 
-    // version 0 is the flag that the object exists only in memory.
-    //  if (obj->version > 0)
-    //    backstore->deallocate(obj->id, obj->version); // Don't want to deallocate the old version immediately
-    obj->old_version = obj->version; // Store the old version
-    obj->version = new_version_id;
-    // for checkpointing
+  // Only one write per object is in flight at a time, so that the
+  // version it replaces is on disk before we free it.
+  wait_for_write_back(obj->id);
+
+  // version 0 is the flag that the object exists only in memory.
+  // A version that no master record names, whether published or
+  // in progress, can go as soon as it is superseded.  The others
+  // are freed by finish_checkpoint().
+  if (obj->version > 0 && obj->version != obj->checkpoint_version &&
+      obj->version != snapshot_version(obj))
+    retire_version(obj->id, obj->version);
+  obj->version = new_version_id;
+  obj->pending_image.reset();
+  obj->image_is_dirty = false;
+
+  if (write_back_threads.empty() && !backstore->asynchronous())
+    write_image(obj->id, new_version_id, image);
+  else
+    queue_write_back(obj, std::make_shared<const std::string>(std::move(image)));
+
+  // An object is only pending while unmodified since the snapshot,
+  // so this write is its snapshot state, whoever asked for it.
+  if (obj->snapshot_pending)
+  {
     object_store[obj->id] = new_version_id;
+    obj->snapshot_pending = false;
+  }
+}
+
+// Take obj out of memory, into the compressed tier if there is one.
+void swap_space::evict(swap_space::object *obj)
+{
+  if (max_compressed_cache_bytes == 0)
+  {
+    write_back(obj, true);
+  }
+  else
+  {
+    std::string payload = serialize_target(obj, true);
+    compress_image(obj, encode_object_header(format, obj->is_leaf, payload) + payload);
+    obj->image_is_dirty |= obj->target_is_dirty;
     obj->target_is_dirty = false;
   }
+
+  delete obj->target.load();
+  obj->target = NULL;
+  current_in_memory_objects--;
+  current_in_memory_bytes -= obj->footprint;
+  obj->footprint = 0;
 }
 
-// attempt to evict an unused object from the swap space
-// objects in swap space are referenced in a priority queue
-// pull objects with low counts first to try and find an object with pincount 0.
+// Evict unpinned objects until we are within budget.  The hand
+// clears the reference bits it passes and takes the first unpinned
+// object whose bit was already clear, so two trips around the ring
+// find a victim unless everything is pinned.
 void swap_space::maybe_evict_something(void)
 {
-  while (current_in_memory_objects > max_in_memory_objects)
+  reap_write_backs();
+  uint64_t steps = 2 * current_in_memory_objects;
+  while (over_budget() && clock_hand != NULL && steps-- > 0)
   {
-    object *obj = NULL;
-    for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); ++it)
-      if ((*it)->pincount == 0)
-      {
-        obj = *it;
-        break;
-      }
-    if (obj == NULL)
-      return;
-    lru_pqueue.erase(obj);
+    object *obj = clock_hand;
+    clock_hand = obj->clock_next;
+    if (obj->resident_round >= resident_round)
+      continue;
+    if (obj->referenced.load(std::memory_order_relaxed))
+    {
+      obj->referenced.store(false, std::memory_order_relaxed);
+      continue;
+    }
+    // Claim obj.  This fails if someone holds or is taking a pin.
+    uint64_t unpinned = 0;
+    if (!obj->pincount.compare_exchange_strong(unpinned, EVICTING))
+      continue;
+    assert(obj->target != NULL);
+    clock_remove(obj);
+    evict(obj);
+    obj->pincount = 0;
+  }
+  spill_compressed_cache();
+}
 
-    write_back(obj);
+bool swap_space::keep_resident(uint64_t id)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  assert(objects.count(id) > 0);
+  object *obj = objects.at(id);
+  if (obj->resident_round == resident_round + 1)
+    return true;
+  if (2 * (next_resident_objects + 1) > max_in_memory_objects ||
+      (max_in_memory_bytes > 0 &&
+       2 * (next_resident_bytes + obj->footprint) > max_in_memory_bytes))
+    return false;
+  obj->resident_round = resident_round + 1;
+  next_resident_objects++;
+  next_resident_bytes += obj->footprint;
+  return true;
+}
 
-    delete obj->target;
-    obj->target = NULL;
-    current_in_memory_objects--;
-  }
+// Objects marked in the round that just ended are now at
+// resident_round; those marked only before are below it.
+void swap_space::end_resident_round(void)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  resident_round++;
+  next_resident_objects = 0;
+  next_resident_bytes = 0;
 }
 
-// Flush the dirty objects in swap_space back to disk
-void swap_space::checkpoint()
+void swap_space::begin_checkpoint(uint64_t lsn)
 {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  assert(!checkpoint_running);
+  checkpoint_running = true;
+  checkpoint_lsn = lsn;
+  checkpoint_root = root;
+  object_store.clear();
+  checkpoint_queue.clear();
   for (auto it = objects.begin(); it != objects.end(); ++it)
   {
     object *obj = it->second;
-
-    if (obj->target_is_dirty)
+    if (obj->target_is_dirty || obj->image_is_dirty)
     {
-      lru_pqueue.erase(obj);
-
-      debug(std::cout << "Checkpoint Writing back " << obj->id << "_" << obj->version
-                      << " (" << obj->target << ") "
-                      << "is dirty " << obj->target_is_dirty << std::endl);
-
-      write_back(obj);
-      delete obj->target;
-      obj->target = NULL;
-      current_in_memory_objects--;
+      obj->snapshot_pending = true;
+      checkpoint_queue.push_back(obj->id);
+    }
+    else
+    {
+      assert(obj->version > 0);
+      object_store[obj->id] = obj->version;
     }
   }
 }
 
+bool swap_space::checkpoint_step(size_t max_writes)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  assert(checkpoint_running);
+  // The snapshot's writes are only queued in the backing store, and
+  // go to it together once the last step has queued its share.
+  batching_write_backs = true;
+  while (max_writes > 0 && !checkpoint_queue.empty())
+  {
+    uint64_t id = checkpoint_queue.back();
+    checkpoint_queue.pop_back();
 
-void swap_space::deallocate_old_versions()
+    // Skip objects that have been deleted or written since.
+    auto it = objects.find(id);
+    if (it == objects.end() || !it->second->snapshot_pending)
+      continue;
+
+    debug(std::cout << "Checkpoint Writing back " << id << "_" << it->second->version
+                    << " (" << it->second->target << ") " << std::endl);
+    write_back(it->second, false);
+    max_writes--;
+  }
+  batching_write_backs = false;
+  if (checkpoint_queue.empty())
+    backstore->submit();
+  return checkpoint_queue.empty();
+}
+
+// Publish the snapshot, then free every version that only the
+// previous master record named.
+void swap_space::finish_checkpoint(void)
 {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  assert(checkpoint_running && checkpoint_queue.empty());
+  wait_for_all_write_backs();
+  reap_write_backs();
+  update_master_record();
+
   for (auto it = objects.begin(); it != objects.end(); ++it)
   {
     object *obj = it->second;
-    if (obj->old_version > 0)
+    uint64_t snapshot = snapshot_version(obj);
+    if (obj->checkpoint_version > 0 && obj->checkpoint_version != snapshot &&
+        obj->checkpoint_version != obj->version)
     {
-      debug(std::cout << "Deleting files in if " << obj->id << "_" << obj->old_version << std::endl);
-      backstore->deallocate(obj->id, obj->old_version);
-      obj->old_version = 0;
+      debug(std::cout << "Deleting files in if " << obj->id << "_" << obj->checkpoint_version << std::endl);
+      retire_version(obj->id, obj->checkpoint_version);
     }
+    obj->checkpoint_version = snapshot;
   }
+  for (auto &v : dead_versions)
+    retire_version(v.first, v.second);
+  dead_versions.swap(dead_snapshot_versions);
+  dead_snapshot_versions.clear();
+
+  checkpoint_running = false;
+  object_store.clear();
+  backstore->sync();
 }
 
-void swap_space::update_master_record(uint64_t lsn)
+// The version of obj that the running checkpoint names, 0 if none.
+uint64_t swap_space::snapshot_version(object *obj)
 {
-  std::ofstream master_record("master_record.txt", std::ios::out | std::ios::trunc);
+  if (!checkpoint_running)
+    return 0;
+  auto it = object_store.find(obj->id);
+  return it == object_store.end() ? 0 : it->second;
+}
+
+// obj is being deleted.  Free whatever versions of it no master
+// record can refer to any more.  The running checkpoint still
+// describes the tree from before the deletion, so obj stays in it.
+void swap_space::release_versions(object *obj)
+{
+  if (obj->snapshot_pending)
+    write_back(obj, false);
+  wait_for_write_back(obj->id);
+  cancel_prefetch(obj);
+  uint64_t snapshot = snapshot_version(obj);
+  if (obj->version > 0 && obj->version != obj->checkpoint_version && obj->version != snapshot)
+    retire_version(obj->id, obj->version);
+  if (obj->checkpoint_version > 0 && obj->checkpoint_version != snapshot)
+    dead_versions.push_back(std::make_pair(obj->id, obj->checkpoint_version));
+  if (snapshot > 0)
+    dead_snapshot_versions.push_back(std::make_pair(obj->id, snapshot));
+}
 
-  if (!master_record.is_open())
+// Free a version that no master record names any more, unless a
+// snapshot still does.  Requires cache_mutex.
+void swap_space::retire_version(uint64_t id, uint64_t version)
+{
+  if (snapshot_needs(id, version))
+    retained_versions.push_back(std::make_pair(id, version));
+  else
+    backstore->deallocate(id, version);
+}
+
+bool swap_space::snapshot_needs(uint64_t id, uint64_t version) const
+{
+  for (auto snapshot : snapshots)
   {
-    std::cerr << "update_master_record Failed to access master record from disk" << std::endl;
-    return;
+    auto it = snapshot->versions.find(id);
+    if (it != snapshot->versions.end() && it->second == version)
+      return true;
+  }
+  return false;
+}
+
+std::shared_ptr<swap_snapshot> swap_space::take_snapshot(void)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  if (!master_record.is_published())
+    return NULL;
+  std::shared_ptr<swap_snapshot> snapshot(new swap_snapshot(this));
+  master_record.get(snapshot->lsn, snapshot->root, snapshot->versions);
+  snapshots.push_back(snapshot.get());
+  return snapshot;
+}
+
+// Free the versions that only snapshot was keeping.
+void swap_space::release_snapshot(swap_snapshot *snapshot)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  snapshots.erase(std::find(snapshots.begin(), snapshots.end(), snapshot));
+  std::vector<std::pair<uint64_t, uint64_t> > still_needed;
+  for (auto &v : retained_versions)
+  {
+    if (snapshot_needs(v.first, v.second))
+      still_needed.push_back(v);
+    else
+      backstore->deallocate(v.first, v.second);
+  }
+  retained_versions.swap(still_needed);
+}
+
+swap_snapshot::~swap_snapshot(void)
+{
+  ss->release_snapshot(this);
+}
+
+// The snapshot becomes the checkpoint that recovery uses.
+void swap_space::update_master_record(void)
+{
+  // Everything the record names must be on disk before the record is.
+  backstore->sync();
+  master_record.publish(checkpoint_lsn, checkpoint_root, object_store);
+}
+
+bool swap_space::parse_master_log()
+{
+  return master_record.load(checkpoint_lsn, root, object_store);
+}
+
+// Recreate an on-disk object for everything in the master record.
+// Returns false if there is no checkpoint to rebuild from.
+bool swap_space::rebuild_tree()
+{ 
+  debug(std::cout << "Rebuilding Tree" << std::endl);
+
+  if (!parse_master_log())
+    return false;
+
+  for(auto &entry: object_store) {
+    debug(std::cout << "ID" << entry.first << std::endl);
+
+    object *create_obj = new object(this, nullptr);
+    create_obj->id = entry.first;
+    create_obj->version = entry.second;
+    create_obj->checkpoint_version = entry.second;
+
+    create_obj->target_is_dirty = false;
+
+    // The header tells us whether the object holds any pointers, which
+    // is all we need until the object itself gets loaded.
+    std::iostream *in = backstore->get(entry.first, entry.second);
+    object_header hdr;
+    bool ok = read_object_header(*in, hdr);
+    backstore->put(in);
+    if (!ok)
+    {
+      std::cerr << "Bad header in object " << entry.first << " version " << entry.second << std::endl;
+      abort();
+    }
+    create_obj->is_leaf = hdr.is_leaf;
+
+    objects[entry.first] = create_obj;
+
+    if (entry.first >= next_id)
+      next_id = entry.first + 1;
   }
+  object_store.clear();
+  return true;
+}
+///////////////////////
+// Compressed tier   //
+///////////////////////
+
+// Put obj's image at the most recently evicted end of the tier.
+void swap_space::compress_image(swap_space::object *obj, const std::string &image)
+{
+  assert(!obj->in_compressed_cache);
+  obj->compressed_image = compress_image_bytes(image);
+  obj->image_length = image.size();
+  obj->in_compressed_cache = true;
+  compressed_cache_bytes += obj->compressed_image.size();
+
+  obj->tier_prev = tier_tail;
+  obj->tier_next = NULL;
+  if (tier_tail)
+    tier_tail->tier_next = obj;
+  else
+    tier_head = obj;
+  tier_tail = obj;
+}
 
-  
-  debug(std::cout << "LSN->" << lsn << std::endl);
-  master_record << lsn << std::endl;
+// Remove obj's image from the tier and return it, still compressed.  If
+// the image was never written, image_is_dirty stays set, so the
+// loaded copy still gets written; target_is_dirty stays clear, as for
+// any freshly loaded object.
+std::string swap_space::take_compressed_image(swap_space::object *obj)
+{
+  std::string image = obj->compressed_image;
+  drop_compressed_image(obj);
+  return image;
+}
+
+void swap_space::drop_compressed_image(swap_space::object *obj)
+{
+  if (!obj->in_compressed_cache)
+    return;
+  if (obj->tier_prev)
+    obj->tier_prev->tier_next = obj->tier_next;
+  else
+    tier_head = obj->tier_next;
+  if (obj->tier_next)
+    obj->tier_next->tier_prev = obj->tier_prev;
+  else
+    tier_tail = obj->tier_prev;
+  obj->tier_prev = NULL;
+  obj->tier_next = NULL;
 
-  debug(std::cout << "Root->" << root << std::endl);
-  master_record << root << std::endl;
+  compressed_cache_bytes -= obj->compressed_image.size();
+  std::string().swap(obj->compressed_image);
+  obj->in_compressed_cache = false;
+}
 
-  for (const auto &entry : object_store)
+// Push the least recently evicted images out to the backing store
+// until the tier fits its budget.
+void swap_space::spill_compressed_cache(void)
+{
+  while (compressed_cache_bytes > max_compressed_cache_bytes)
   {
-    debug(std::cout << "Update Master File" << entry.first << " " << entry.second << " " << entry.second<< std::endl);
-    master_record << entry.first << ":" << entry.second << std::endl;
+    object *obj = tier_head;
+    assert(obj != NULL);
+    write_back(obj, true);
+    drop_compressed_image(obj);
   }
+}
 
-  // master_record.close();
+void swap_space::set_compressed_cache_size(uint64_t bytes)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  max_compressed_cache_bytes = bytes;
+  spill_compressed_cache();
 }
 
+void swap_space::set_manifest_min_compact_bytes(uint64_t bytes)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  master_record.set_min_compact_bytes(bytes);
+}
+
+///////////////////////
+// Write-back pool   //
+///////////////////////
 
-void swap_space::parse_master_log()
+// Write one object image to the backing store.  Runs on the worker
+// threads, so it must not touch anything but the backing store.
+void swap_space::write_image(uint64_t id, uint64_t version, const std::string &image)
 {
-  debug(std::cout << "Inside Parse master log" << std::endl);
-  std::ifstream master_log("master_record.txt");
+  backstore->allocate(id, version);
+  std::iostream *out = backstore->get(id, version);
+  out->write(image.data(), image.length());
+  backstore->put(out);
+}
 
-  if (!master_log.is_open())
+// Hand obj's new version to the pool, waiting for room if the queue
+// is full.  obj keeps the image so it can be reloaded meanwhile.  An
+// asynchronous backing store takes the write directly instead; it is
+// submitted right away, along with whatever checkpoint writes are
+// queued, unless it is itself one of a checkpoint step's writes.
+void swap_space::queue_write_back(object *obj, std::shared_ptr<const std::string> image)
+{
+  obj->pending_image = image;
+  if (backstore->asynchronous())
   {
-    std::cerr << "Parse master Failed to access master record from disk" << std::endl;
+    uint64_t id = obj->id;
+    uint64_t version = obj->version;
+    {
+      std::lock_guard<std::mutex> lock(write_back_mutex);
+      writes_in_flight[id] = version;
+    }
+    backstore->allocate(id, version);
+    backstore->write(id, version, image, [this, id, version] {
+      std::lock_guard<std::mutex> lock(write_back_mutex);
+      finish_write_back(id, version);
+    });
+    if (!batching_write_backs)
+      backstore->submit();
     return;
   }
 
-  // lsn
-  std::string line;
+  std::unique_lock<std::mutex> lock(write_back_mutex);
+  write_back_finished.wait(lock, [this] { return writes_in_flight.size() < write_back_queue_depth; });
+  writes_in_flight[obj->id] = obj->version;
+  write_back_task task;
+  task.id = obj->id;
+  task.version = obj->version;
+  task.image = image;
+  write_back_queue.push_back(task);
+  write_back_ready.notify_one();
+}
 
-  std::string lsn;
-  if (std::getline(master_log, line))
+void swap_space::wait_for_write_back(uint64_t id)
+{
+  backstore->submit();
+  std::unique_lock<std::mutex> lock(write_back_mutex);
+  write_back_finished.wait(lock, [this, id] { return writes_in_flight.count(id) == 0; });
+}
+
+void swap_space::wait_for_all_write_backs(void)
+{
+  backstore->submit();
+  std::unique_lock<std::mutex> lock(write_back_mutex);
+  write_back_finished.wait(lock, [this] { return writes_in_flight.empty(); });
+}
+
+void swap_space::drain_write_backs(void)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  wait_for_all_write_backs();
+  reap_write_backs();
+}
+
+// Drop the images of versions that have reached the backing store.
+void swap_space::reap_write_backs(void)
+{
+  std::vector<std::pair<uint64_t, uint64_t> > done;
   {
-    std::istringstream iss(line);
-    iss >> lsn;
+    std::lock_guard<std::mutex> lock(write_back_mutex);
+    if (completed_writes.empty())
+      return;
+    done.swap(completed_writes);
   }
-
-  // root
-  if (std::getline(master_log, line))
+  for (auto &w : done)
   {
-    std::istringstream iss(line);
-    iss >> root;
+    auto it = objects.find(w.first);
+    if (it != objects.end() && it->second->version == w.second)
+      it->second->pending_image.reset();
   }
+}
 
-  // k, v
-  while (std::getline(master_log, line))
+void swap_space::write_back_worker(void)
+{
+  std::unique_lock<std::mutex> lock(write_back_mutex);
+  while (true)
   {
-    std::istringstream iss(line);
-    u_int64_t key, version;
-    char delimiter;
+    write_back_ready.wait(lock, [this] { return write_back_stopping || !write_back_queue.empty(); });
+    if (write_back_queue.empty())
+      return;
+    write_back_task task = write_back_queue.front();
+    write_back_queue.pop_front();
 
-    debug(std::cout << "root " << root << std::endl);
-    if (iss >> key >> delimiter >> version && delimiter == ':')
-    {
-      debug(std::cout << " parse_master_log " << key << " " << version << std::endl);
+    lock.unlock();
+    write_image(task.id, task.version, *task.image);
+    lock.lock();
 
-      object *create_obj = new object(this, nullptr);
-      create_obj->id = key;
-      create_obj->version = version;
+    finish_write_back(task.id, task.version);
+  }
+}
 
-      object_store[key] = version;
-    }
+// Requires write_back_mutex.
+void swap_space::finish_write_back(uint64_t id, uint64_t version)
+{
+  writes_in_flight.erase(id);
+  completed_writes.push_back(std::make_pair(id, version));
+  write_back_finished.notify_all();
+}
+
+void swap_space::start_write_back_threads(unsigned int n)
+{
+  assert(write_back_threads.empty());
+  write_back_stopping = false;
+  for (unsigned int i = 0; i < n; i++)
+    write_back_threads.push_back(std::thread(&swap_space::write_back_worker, this));
+}
+
+// Finishes everything already queued first.
+void swap_space::stop_write_back_threads(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(write_back_mutex);
+    write_back_stopping = true;
   }
+  write_back_ready.notify_all();
+  for (auto &t : write_back_threads)
+    t.join();
+  write_back_threads.clear();
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  wait_for_all_write_backs();
+  reap_write_backs();
+}
 
-  // master_log.close();
+void swap_space::set_write_back_threads(unsigned int n)
+{
+  stop_write_back_threads();
+  start_write_back_threads(n);
 }
 
-void swap_space::rebuild_tree()
-{ 
-  debug(std::cout << "Rebuilding Tree" << std::endl);
+void swap_space::set_write_back_queue_depth(size_t n)
+{
+  assert(n > 0);
+  std::lock_guard<std::mutex> lock(write_back_mutex);
+  write_back_queue_depth = n;
+  write_back_finished.notify_all();
+}
 
-  parse_master_log();
+///////////////////////
+// Prefetch pool     //
+///////////////////////
 
-  for(auto &entry: object_store) {
-    debug(std::cout << "ID" << entry.first << std::endl);
+// Queue a read of object id's stored image, unless it is already in
+// memory or on its way there.  When too many prefetched images are
+// waiting to be loaded, the oldest one that has arrived is dropped to
+// make room; if none has, this prefetch is skipped.
+void swap_space::prefetch(uint64_t id)
+{
+  assert(objects.count(id) > 0);
+  object *obj = objects.at(id);
+  std::lock_guard<std::mutex> cache_lock(cache_mutex);
+  if (prefetch_threads.empty() || obj->target != NULL || obj->loading || obj->version == 0 ||
+      obj->in_compressed_cache || obj->pending_image)
+    return;
 
-    object *create_obj = new object(this, nullptr);
-    create_obj->id = entry.first;
-    create_obj->version = entry.second;
+  std::lock_guard<std::mutex> lock(prefetch_mutex);
+  if (prefetches.count(id) > 0)
+    return;
+  if (prefetches.size() >= prefetch_depth)
+  {
+    uint64_t oldest = prefetch_order.front();
+    if (!prefetches[oldest]->done)
+      return;
+    prefetches.erase(oldest);
+    prefetch_order.pop_front();
+  }
 
-    create_obj->target_is_dirty = false;
-    
-    std::string loc = backstore->get_version_file(entry.first, entry.second);
+  std::shared_ptr<prefetch_slot> slot = std::make_shared<prefetch_slot>();
+  slot->id = id;
+  slot->version = obj->version;
+  slot->done = false;
+  prefetches[id] = slot;
+  prefetch_order.push_back(id);
+  prefetch_queue.push_back(slot);
+  prefetch_ready.notify_one();
+}
 
-    std::cout << "Reading data file " << loc << std::endl;
+// If obj was prefetched, take over the read, finished or not.
+// Returns NULL if it was not.
+std::shared_ptr<swap_space::prefetch_slot> swap_space::take_prefetch(swap_space::object *obj)
+{
+  std::lock_guard<std::mutex> lock(prefetch_mutex);
+  auto it = prefetches.find(obj->id);
+  if (it == prefetches.end())
+    return NULL;
+  std::shared_ptr<prefetch_slot> slot = it->second;
+  // Objects that are not in memory keep their version.
+  assert(slot->version == obj->version);
+  forget_prefetch(obj->id);
+  return slot;
+}
 
-    std::ifstream tree_data(loc);
+// Wait for the read of a slot taken with take_prefetch() and return
+// the image.
+std::string swap_space::wait_for_prefetch(std::shared_ptr<prefetch_slot> slot)
+{
+  std::unique_lock<std::mutex> lock(prefetch_mutex);
+  prefetch_finished.wait(lock, [&slot] { return slot->done; });
+  std::string image;
+  image.swap(slot->image);
+  return image;
+}
 
-    if (!tree_data)
-    {
-      std::cerr << "Failed to data file on disk " << loc << std::endl;
-      return;
-    }
+// obj's stored versions are about to be freed, so make sure no read
+// of them is still running.
+void swap_space::cancel_prefetch(swap_space::object *obj)
+{
+  std::unique_lock<std::mutex> lock(prefetch_mutex);
+  auto it = prefetches.find(obj->id);
+  if (it == prefetches.end())
+    return;
+  std::shared_ptr<prefetch_slot> slot = it->second;
+  prefetch_finished.wait(lock, [&slot] { return slot->done; });
+  forget_prefetch(obj->id);
+}
 
-    std::string line;
-    std::string map, pivot;
+// Requires prefetch_mutex.
+void swap_space::forget_prefetch(uint64_t id)
+{
+  prefetches.erase(id);
+  prefetch_order.erase(std::find(prefetch_order.begin(), prefetch_order.end(), id));
+}
 
-    if (std::getline(tree_data, line))
-    {
-      std::istringstream iss(line);
-      debug(std::cout << "" << std::endl);
-    }
+void swap_space::prefetch_worker(void)
+{
+  std::unique_lock<std::mutex> lock(prefetch_mutex);
+  while (true)
+  {
+    prefetch_ready.wait(lock, [this] { return prefetch_stopping || !prefetch_queue.empty(); });
+    if (prefetch_queue.empty())
+      return;
+    std::shared_ptr<prefetch_slot> slot = prefetch_queue.front();
+    prefetch_queue.pop_front();
 
-    while (std::getline(tree_data, line))
-    {
-      std::istringstream iss(line);
-      
-      iss >> map >> pivot;
+    lock.unlock();
+    std::string image;
+    backstore->read(slot->id, slot->version, image);
+    lock.lock();
 
-      debug(std::cout << "PIVOT" << " "  << pivot << std::endl);
-      
-      break;
-    }
+    slot->image.swap(image);
+    slot->done = true;
+    prefetch_finished.notify_all();
+  }
+}
 
-    if(!std::stoi(pivot)){
-      create_obj->is_leaf = false;
-    }
+void swap_space::start_prefetch_threads(unsigned int n)
+{
+  assert(prefetch_threads.empty());
+  prefetch_stopping = false;
+  for (unsigned int i = 0; i < n; i++)
+    prefetch_threads.push_back(std::thread(&swap_space::prefetch_worker, this));
+}
 
-    objects[entry.first] = create_obj;
+// Finishes every read already queued first.
+void swap_space::stop_prefetch_threads(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(prefetch_mutex);
+    prefetch_stopping = true;
+  }
+  prefetch_ready.notify_all();
+  for (auto &t : prefetch_threads)
+    t.join();
+  prefetch_threads.clear();
+}
 
+void swap_space::set_prefetch_threads(unsigned int n)
+{
+  stop_prefetch_threads();
+  start_prefetch_threads(n);
 }
- return;
-}
\ No newline at end of file
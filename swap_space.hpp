@@ -46,9 +46,32 @@
 // Objects are automatically garbage collected.  The garbage collector
 // uses reference counting.
 
-// The current system uses LRU to select items to swap.  The swap
-// space has a user-specified in-memory cache size it.  The cache size
-// can be adjusted dynamically.
+// The current system uses CLOCK, an approximation of LRU, to select
+// items to swap.  The swap space has a user-specified in-memory cache
+// size it.  The cache size can be adjusted dynamically.
+
+// The cache can also be bounded in bytes (see set_cache_bytes()).
+// Each object estimates its own footprint through
+// serializable::footprint(); the estimate is refreshed when the object
+// is created, loaded, or loses its last pin after being modified.
+
+// In-memory objects sit on a ring, an intrusive circular list threaded
+// through the objects.  Pinning an object sets its reference bit, and
+// the eviction hand sweeps the ring, clearing reference bits and
+// evicting the first unpinned object whose bit was already clear.
+// Pins never touch the ring, so they need no lock.
+
+// Any number of threads may pin objects and access them through const
+// pointers at the same time.  Modifying, allocating or freeing objects
+// must not overlap with anything else, so there is one writer at a
+// time and it runs alone; the betree enforces this.  Pin counts and
+// reference counts are atomic.  Everything else that a reader can
+// change (the ring, the cache sizes, the compressed tier, eviction and
+// loading) is protected by cache_mutex.  An object is loaded by one
+// thread while any others that want it wait, and the read itself
+// happens outside the lock.  An evictor claims an object by swapping
+// its pin count from 0 to EVICTING, so a pin that races with the
+// eviction waits for it to finish and then loads the object again.
 
 // Don't try to get your hands on an unwrapped pointer to the object
 // or anything that is swapped in/out as part of the object.  It can
@@ -63,9 +86,65 @@
 // a few basic types and STL containers.  Feel free to add more and
 // submit patches as you need them.
 
-// The current implementation serializes to a textual file format.
-// This is just a convenience.  It would be nice to be able to swap in
-// different formats.
+// Dirty objects are written back by a small pool of background
+// threads, so that the thread that triggered an eviction does not
+// wait for the disk.  The evicting thread serializes the object and
+// queues the image; until the write lands, a reload of the object is
+// served from that image.  The queue is bounded: when it is full,
+// eviction waits for a slot.  A checkpoint waits for every queued
+// write before the master record can refer to it.  A backing store
+// that writes asynchronously (see backing_store::asynchronous()) needs
+// no pool: writes go straight to it.  Checkpoint steps only queue
+// theirs, and the whole snapshot is submitted once its last write is
+// queued, or sooner if some other write or read submits first.
+
+// Checkpoints are fuzzy: they do not stop the world or empty the
+// cache.  begin_checkpoint() takes a snapshot of the object graph as
+// of a given LSN.  Objects that were clean at that point are already
+// on disk; the dirty ones are written out over time by
+// checkpoint_step(), and are written out early if they are about to be
+// modified or evicted first, so that what reaches the disk is always
+// their state as of the snapshot.  Checkpoint writes leave the object
+// in memory, now clean.  finish_checkpoint() publishes the master
+// record once every write of the snapshot is on the backing store.
+
+// Evicted objects can be kept in a second, compressed tier instead of
+// going straight to the backing store (see set_compressed_cache_size()).
+// The tier holds the zlib-compressed stored image of each object and
+// is bounded in bytes rather than in objects.  Reloading an object from
+// the tier does not touch the backing store.  When the tier overflows,
+// its least recently evicted images spill out, and only then are dirty
+// ones written back.
+
+// Some objects can be made resident: the hand passes over them, so
+// they stay in memory however cold they are.  They still count against
+// the cache limits, and may take at most half of the cache, so that
+// the rest still has room to work.  The resident set is replaced as a
+// whole, in rounds (see end_resident_round()), so the caller need not
+// remember which objects it marked before.
+
+// A published checkpoint can be held open for reading (see
+// take_snapshot()).  The object versions it names are then not freed,
+// however many checkpoints follow, until the snapshot is released.
+// Its objects are read straight from the backing store into memory
+// that the snapshot owns, so it neither uses nor disturbs the cache,
+// and its pointers are not reference counted.
+
+// Callers that know which objects they are about to touch can start
+// reading them early with pointer::prefetch().  A small pool of
+// threads reads the stored images in the background, and a later load
+// of the object picks the image up instead of going to the backing
+// store itself.  Prefetching is only a hint, and the number of
+// outstanding prefetched images is bounded.
+
+// Objects are stored in a compact binary format: fixed-width
+// little-endian integers and length-prefixed strings, with no
+// separators.  Each stored object starts with a versioned header
+// holding the payload length and a CRC-32C of the payload, so
+// corruption is detected on load.  The original textual format is
+// still available (see set_node_format()) for debugging.  The header
+// records which format an object was written in, so a store may mix
+// the two.
 
 #ifndef SWAP_SPACE_HPP
 #define SWAP_SPACE_HPP
@@ -73,24 +152,45 @@
 #include <cstdint>
 #include <unordered_map>
 #include <map>
-#include <set>
 #include <functional>
 #include <sstream>
 #include <cassert>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include "backing_store.hpp"
+#include "manifest.hpp"
+#include "flat_map.hpp"
 #include "debug.hpp"
 
 class swap_space;
+class swap_snapshot;
+
+enum node_format
+{
+  NODE_FORMAT_BINARY = 0,
+  NODE_FORMAT_TEXT = 1
+};
 
 class serialization_context
 {
 public:
-  serialization_context(swap_space &sspace) : ss(sspace),
-                                              is_leaf(true)
+  serialization_context(swap_space &sspace, node_format fmt) : ss(sspace),
+                                                               format(fmt),
+                                                               is_leaf(true),
+                                                               detach(true),
+                                                               snapshot(NULL)
   {
   }
   swap_space &ss;
+  node_format format;
   bool is_leaf;
+  bool detach;  // Serialized pointers let go of their target (eviction)
+  const swap_snapshot *snapshot;  // Deserialized pointers point into it
 };
 
 class serializable
@@ -98,6 +198,9 @@ class serializable
 public:
   virtual void _serialize(std::iostream &fs, serialization_context &context) = 0;
   virtual void _deserialize(std::iostream &fs, serialization_context &context) = 0;
+  // Approximate bytes of memory used by the object, including what it
+  // owns.  Called often, so it should be cheap rather than exact.
+  virtual uint64_t footprint(void) const = 0;
   virtual ~serializable(void) {};
 };
 
@@ -107,62 +210,128 @@ void deserialize(std::iostream &fs, serialization_context &context, uint64_t &x)
 void serialize(std::iostream &fs, serialization_context &context, int64_t x);
 void deserialize(std::iostream &fs, serialization_context &context, int64_t &x);
 
-void serialize(std::iostream &fs, serialization_context &context, std::string x);
+void serialize(std::iostream &fs, serialization_context &context, uint8_t x);
+void deserialize(std::iostream &fs, serialization_context &context, uint8_t &x);
+
+void serialize(std::iostream &fs, serialization_context &context, const std::string &x);
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x);
 
-template <class Key, class Value>
-void serialize(std::iostream &fs,
-               serialization_context &context,
-               std::map<Key, Value> &mp)
+// Keeps non-const strings from matching the generic X & overload below.
+inline void serialize(std::iostream &fs, serialization_context &context, std::string &x)
+{
+  serialize(fs, context, (const std::string &)x);
+}
+
+// Punctuation that only exists in the text format (labels, "->",
+// braces).  In the binary format these are no-ops.
+void serialize_text(std::iostream &fs, serialization_context &context, const char *text);
+void deserialize_text(std::iostream &fs, serialization_context &context, const char *expected = NULL);
+
+// std::maps and flat_maps share an on-disk representation, so a node
+// written under one layout can be read back under the other.
+template <class Map>
+void serialize_map(std::iostream &fs,
+                   serialization_context &context,
+                   Map &mp)
 {
-  fs << "map " << mp.size() << " {" << std::endl;
+  serialize_text(fs, context, "map ");
+  serialize(fs, context, (uint64_t)mp.size());
+  serialize_text(fs, context, "{\n");
   assert(fs.good());
   for (auto it = mp.begin(); it != mp.end(); ++it)
   {
-    fs << "  ";
+    serialize_text(fs, context, "  ");
     serialize(fs, context, it->first);
-    fs << " -> ";
+    serialize_text(fs, context, " -> ");
     serialize(fs, context, it->second);
-    fs << std::endl;
+    serialize_text(fs, context, "\n");
   }
-  fs << "}" << std::endl;
+  serialize_text(fs, context, "}\n");
 }
 
-template <class Key, class Value>
-void deserialize(std::iostream &fs,
-                 serialization_context &context,
-                 std::map<Key, Value> &mp)
+template <class Map>
+void deserialize_map(std::iostream &fs,
+                     serialization_context &context,
+                     Map &mp)
 {
-  std::string dummy;
-  int size = 0;
-  fs >> dummy >> size >> dummy;
+  uint64_t size = 0;
+  deserialize_text(fs, context, "map");
+  deserialize(fs, context, size);
+  deserialize_text(fs, context, "{");
   assert(fs.good());
-  for (int i = 0; i < size; i++)
+  for (uint64_t i = 0; i < size; i++)
   {
-    Key k;
-    Value v;
+    typename Map::key_type k;
+    typename Map::mapped_type v;
     deserialize(fs, context, k);
-    fs >> dummy;
+    deserialize_text(fs, context, "->");
     deserialize(fs, context, v);
-    mp[k] = v;
+    mp.emplace_hint(mp.end(), k, std::move(v));
   }
-  fs >> dummy;
+  deserialize_text(fs, context, "}");
+}
+
+template <class Key, class Value, class Compare, class Alloc>
+void serialize(std::iostream &fs,
+               serialization_context &context,
+               std::map<Key, Value, Compare, Alloc> &mp)
+{
+  serialize_map(fs, context, mp);
+}
+
+template <class Key, class Value, class Compare, class Alloc>
+void deserialize(std::iostream &fs,
+                 serialization_context &context,
+                 std::map<Key, Value, Compare, Alloc> &mp)
+{
+  deserialize_map(fs, context, mp);
+}
+
+template <class Key, class Value>
+void serialize(std::iostream &fs,
+               serialization_context &context,
+               flat_map<Key, Value> &mp)
+{
+  serialize_map(fs, context, mp);
+}
+
+template <class Key, class Value>
+void deserialize(std::iostream &fs,
+                 serialization_context &context,
+                 flat_map<Key, Value> &mp)
+{
+  deserialize_map(fs, context, mp);
+}
+
+// Heap bytes owned by a value, for footprint() estimates.  Plain
+// values own none.
+template <class X>
+uint64_t heap_footprint(const X &)
+{
+  return 0;
+}
+
+// Short strings live inside the std::string itself.
+inline uint64_t heap_footprint(const std::string &x)
+{
+  const char *p = x.data();
+  if (p >= (const char *)&x && p < (const char *)(&x + 1))
+    return 0;
+  return x.capacity() + 1;
 }
 
 template <class X>
 void serialize(std::iostream &fs, serialization_context &context, X *&x)
 {
-  fs << "pointer ";
+  serialize_text(fs, context, "pointer ");
   serialize(fs, context, *x);
 }
 
 template <class X>
 void deserialize(std::iostream &fs, serialization_context &context, X *&x)
 {
-  std::string dummy;
   x = new X;
-  fs >> dummy;
-  assert(dummy == "pointer");
+  deserialize_text(fs, context, "pointer");
   deserialize(fs, context, *x);
 }
 
@@ -178,18 +347,100 @@ void deserialize(std::iostream &fs, serialization_context &context, X &x)
   x._deserialize(fs, context);
 }
 
+// A published checkpoint held open for reading; see
+// swap_space::take_snapshot().  Released when the last reference to it
+// goes away, which must happen before the swap space is destroyed.
+class swap_snapshot
+{
+public:
+  swap_snapshot(const swap_snapshot &) = delete;
+  swap_snapshot &operator=(const swap_snapshot &) = delete;
+  ~swap_snapshot(void);
+
+  uint64_t get_lsn(void) const { return lsn; }
+
+private:
+  friend class swap_space;
+
+  swap_snapshot(swap_space *sspace) : ss(sspace) {}
+
+  swap_space *ss;
+  uint64_t lsn;
+  uint64_t root;
+  std::unordered_map<uint64_t, uint64_t> versions;  // id -> version
+
+  // Objects that hold pointers, once read.  Leaves are read again on
+  // every access, so only the upper levels of the tree stay in memory.
+  mutable std::mutex cache_mutex;
+  mutable std::unordered_map<uint64_t, std::shared_ptr<const serializable> > cache;
+};
+
+#define DEFAULT_WRITE_BACK_THREADS (2)
+#define DEFAULT_WRITE_BACK_QUEUE_DEPTH (16)
+#define DEFAULT_PREFETCH_THREADS (4)
+#define DEFAULT_PREFETCH_DEPTH (32)
+
+// In bytes.  0 disables the compressed tier.
+#define DEFAULT_COMPRESSED_CACHE_SIZE (0)
+
 class swap_space
 {
+  class object;
+
 public:
   swap_space(backing_store *bs, uint64_t n, uint64_t checkpoint_granularity);
+  ~swap_space(void);
 
   uint64_t root;
-  void checkpoint();
-  void deallocate_old_versions();
-  void update_master_record(uint64_t lsn);
 
-  void parse_master_log();
-  void rebuild_tree();
+  // Snapshot the current state of every object as the checkpoint for
+  // lsn.  Only one checkpoint can be in progress at a time.
+  void begin_checkpoint(uint64_t lsn);
+  // Write up to max_writes objects of the snapshot.  Returns true once
+  // all of them have been written (though maybe not yet landed).
+  bool checkpoint_step(size_t max_writes);
+  // Wait for the snapshot to land and make it the one recovery uses.
+  void finish_checkpoint(void);
+  bool checkpoint_in_progress(void) const { return checkpoint_running; }
+  // The LSN of the running checkpoint, or else of the last one
+  // published or restored.
+  uint64_t get_checkpoint_lsn(void) const { return checkpoint_lsn; }
+
+  bool parse_master_log();
+  bool rebuild_tree();
+
+  // Format used for objects written from now on.
+  void set_node_format(node_format fmt);
+
+  // Bytes that in-memory objects may occupy, on top of the limit on
+  // their number.  0 means only the number is limited.
+  void set_cache_bytes(uint64_t bytes);
+
+  // Bytes of compressed images to keep in memory after eviction.
+  void set_compressed_cache_size(uint64_t bytes);
+
+  // How long the master record's log may grow before it is compacted
+  // (see manifest::set_min_compact_bytes()).
+  void set_manifest_min_compact_bytes(uint64_t bytes);
+
+  // 0 threads makes every write-back synchronous.
+  void set_write_back_threads(unsigned int n);
+  void set_write_back_queue_depth(size_t n);
+
+  // Wait until every queued write-back is on the backing store.
+  void drain_write_backs(void);
+
+  // 0 threads turns prefetching off.
+  void set_prefetch_threads(unsigned int n);
+
+  // The objects marked with pointer::keep_resident() since the last
+  // call become the resident set.  Until then the previous set stays
+  // resident too.
+  void end_resident_round(void);
+
+  // Hold the last published checkpoint open for reading.  Returns NULL
+  // if nothing has been published or restored yet.
+  std::shared_ptr<swap_snapshot> take_snapshot(void);
   
   template <class Referent>
   class pointer;
@@ -199,9 +450,39 @@ public:
   template <class Referent>
   pointer<Referent> allocate(Referent *tgt)
   {
-    pointer<Referent> root_ptr = pointer<Referent>(this, tgt);
-    root = root_ptr.target;
-    return root_ptr;
+    return pointer<Referent>(this, tgt);
+  }
+
+  // The tree tells us which object is its root, so that the master
+  // record can point at it.
+  template <class Referent>
+  void set_root(const pointer<Referent> &p)
+  {
+    root = p.target;
+  }
+
+  // Return a pointer to the root named in the master record.  Only
+  // valid after rebuild_tree().  rebuild_tree() gives every object
+  // one reference, which for the root is the one we hand out here.
+  template <class Referent>
+  pointer<Referent> get_root(void)
+  {
+    assert(objects.count(root) > 0);
+    pointer<Referent> p;
+    p.ss = this;
+    p.target = root;
+    return p;
+  }
+
+  // Return a read-only pointer to the root of snapshot.  Everything
+  // reached through it comes from the snapshot.
+  template <class Referent>
+  static pointer<Referent> get_snapshot_root(const swap_snapshot &snapshot)
+  {
+    pointer<Referent> p;
+    p.snap = &snapshot;
+    p.target = snapshot.root;
+    return p;
   }
 
 
@@ -214,35 +495,57 @@ public:
   public:
     const Referent *operator->(void) const
     {
-      assert(ss->objects.count(target) > 0);
+      if (frozen)
+        return static_cast<const Referent *>(frozen.get());
       debug(std::cout << "Accessing (constly) " << target
-                      << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-      access(target, false);
-      return (const Referent *)ss->objects[target]->target;
+                      << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+      access(false);
+      return (const Referent *)obj->target.load();
     }
 
     Referent *operator->(void)
     {
-      assert(ss->objects.count(target) > 0);
+      assert(!frozen);  // Snapshots are read-only
       debug(std::cout << "Accessing " << target
-                      << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-      access(target, true);
-      return (Referent *)ss->objects[target]->target;
+                      << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+      access(true);
+      return (Referent *)obj->target.load();
     }
 
     pin(const pointer<Referent> *p)
         : ss(NULL),
-          target(0)
+          target(0),
+          obj(NULL)
     {
-      dopin(p->ss, p->target);
+      if (p->target > 0 && p->snap)
+      {
+        frozen = read_snapshot_object<Referent>(*p->snap, p->target);
+      }
+      else if (p->target > 0)
+      {
+        assert(p->ss->objects.count(p->target) > 0);
+        dopin(p->ss, p->target, p->ss->objects.at(p->target));
+      }
     }
 
     pin(void)
         : ss(NULL),
-          target(0)
+          target(0),
+          obj(NULL)
     {
     }
 
+    // Each copy holds its own pin, so pins can be stored in
+    // containers.  Copying does not look in the object table.
+    pin(const pin &other)
+        : ss(NULL),
+          target(0),
+          obj(NULL),
+          frozen(other.frozen)
+    {
+      dopin(other.ss, other.target, other.obj);
+    }
+
     ~pin(void)
     {
       unpin();
@@ -253,56 +556,86 @@ public:
       if (&other != this)
       {
         unpin();
-        dopin(other.ss, other.target);
+        dopin(other.ss, other.target, other.obj);
+        frozen = other.frozen;
       }
+      return *this;
     }
 
   private:
     // called when pointer no longer accessed - remove pincount and maybe evict from cache.
     void unpin(void)
     {
-      debug(std::cout << "Unpinning " << target
-                      << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
       if (target > 0)
       {
-        assert(ss->objects.count(target) > 0);
-        ss->objects[target]->pincount--;
-        ss->maybe_evict_something();
+        debug(std::cout << "Unpinning " << target
+                        << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+        // Only the writer dirties objects, and it runs alone, but
+        // once our pin is gone an evictor may clean obj, so look now.
+        bool modified = obj->target_is_dirty;
+        if (--obj->pincount == 0 && modified)
+        {
+          std::lock_guard<std::mutex> lock(ss->cache_mutex);
+          if (obj->target != NULL)
+            ss->update_footprint(obj);
+        }
+        if (ss->over_budget())
+        {
+          std::lock_guard<std::mutex> lock(ss->cache_mutex);
+          ss->maybe_evict_something();
+        }
       }
       ss = NULL;
       target = 0;
+      obj = NULL;
+      frozen.reset();
     }
 
-    // Called when creating pin type - assert target exists, then force load in ss.
-    void dopin(swap_space *newss, uint64_t newtarget)
+    // Called when creating pin type.  The object is loaded on first access.
+    void dopin(swap_space *newss, uint64_t newtarget, object *newobj)
     {
       assert(ss == NULL && target == 0);
       ss = newss;
       target = newtarget;
+      obj = newobj;
       if (target > 0)
       {
-        assert(ss->objects.count(target) > 0);
         debug(std::cout << "Pinning " << target
-                        << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-        ss->objects[target]->pincount++;
+                        << " id " << obj->id << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+        uint64_t n = obj->pincount;
+        while (!(n & EVICTING) && !obj->pincount.compare_exchange_weak(n, n + 1))
+          ;
+        if (n & EVICTING)
+        {
+          // Evictions run under the lock, so once we have it this
+          // one is over.
+          std::lock_guard<std::mutex> lock(ss->cache_mutex);
+          obj->pincount++;
+        }
+        if (!obj->referenced.load(std::memory_order_relaxed))
+          obj->referenced.store(true, std::memory_order_relaxed);
       }
     }
 
     // Called when accessing object, forces load - requires object to be pinned.
-    void access(uint64_t tgt, bool dirty) const
+    void access(bool dirty) const
     {
-      assert(ss->objects.count(tgt) > 0);
-      object *obj = ss->objects[tgt];
-      ss->lru_pqueue.erase(obj);
-      obj->last_access = ss->next_access_time++;
-      ss->lru_pqueue.insert(obj);
-      obj->target_is_dirty |= dirty;
-      ss->load<Referent>(tgt);
-      ss->maybe_evict_something();
+      if (dirty)
+      {
+        std::lock_guard<std::mutex> lock(ss->cache_mutex);
+        // The checkpoint needs the state from before this modification.
+        if (obj->snapshot_pending)
+          ss->write_back(obj, false);
+        obj->target_is_dirty = true;
+      }
+      ss->load<Referent>(obj);
     }
 
     swap_space *ss;
     uint64_t target;
+    object *obj;
+    // The object, when pinned through a snapshot pointer
+    std::shared_ptr<const serializable> frozen;
   };
 
   // pointer wrapper that allows for ss control
@@ -316,7 +649,8 @@ public:
     Referent *get() const { return referent; }
 
     pointer(void) : ss(NULL),
-                    target(0)
+                    target(0),
+                    snap(NULL)
     {
     }
 
@@ -324,10 +658,11 @@ public:
     {
       ss = other.ss;
       target = other.target;
-      if (target > 0)
+      snap = other.snap;
+      if (target > 0 && !snap)
       {
         assert(ss->objects.count(target) > 0);
-        ss->objects[target]->refcount++;
+        ss->objects.at(target)->refcount++;
       }
     }
 
@@ -341,9 +676,14 @@ public:
     {
       if (target == 0)
         return;
+      if (snap)
+      {
+        target = 0;
+        return;
+      }
       assert(ss->objects.count(target) > 0);
 
-      object *obj = ss->objects[target];
+      object *obj = ss->objects.at(target);
       assert(obj->refcount > 0);
       if ((--obj->refcount) == 0)
       {
@@ -351,24 +691,30 @@ public:
         // Load it into memory so we can recursively free stuff
         if (obj->target == NULL)
         {
-          assert(obj->version > 0);
+          assert(obj->version > 0 || obj->in_compressed_cache);
           if (!obj->is_leaf)
           {
-            ss->load<Referent>(target);
+            ss->load<Referent>(obj);
           }
           else
           {
             debug(std::cout << "Skipping load of leaf " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
           }
         }
-        ss->objects.erase(target);
-        ss->lru_pqueue.erase(obj);
-        if (obj->target)
-          delete obj->target;
-        ss->current_in_memory_objects--;
-        // Remove files only after checkpointing
-        // if (obj->version > 0)
-        //   ss->backstore->deallocate(obj->id, obj->version);
+        {
+          std::lock_guard<std::mutex> lock(ss->cache_mutex);
+          ss->release_versions(obj);
+          ss->objects.erase(target);
+          ss->drop_compressed_image(obj);
+          if (obj->target)
+          {
+            ss->clock_remove(obj);
+            ss->current_in_memory_objects--;
+            ss->current_in_memory_bytes -= obj->footprint;
+          }
+        }
+        // Outside the lock: this frees our children in turn.
+        delete obj->target.load();
         delete obj;
       }
       target = 0;
@@ -381,10 +727,11 @@ public:
         depoint();
         ss = other.ss;
         target = other.target;
-        if (target > 0)
+        snap = other.snap;
+        if (target > 0 && !snap)
         {
           assert(ss->objects.count(target) > 0);
-          ss->objects[target]->refcount++;
+          ss->objects.at(target)->refcount++;
         }
       }
       return *this;
@@ -392,7 +739,7 @@ public:
 
     bool operator==(const pointer &other) const
     {
-      return ss == other.ss && target == other.target;
+      return ss == other.ss && snap == other.snap && target == other.target;
     }
 
     bool operator!=(const pointer &other) const
@@ -428,21 +775,44 @@ public:
     bool is_in_memory(void) const
     {
       assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target != NULL;
+      return target > 0 && ss->objects.at(target)->target != NULL;
     }
 
     bool is_dirty(void) const
     {
       assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target && ss->objects[target]->target_is_dirty;
+      return target > 0 && ss->objects.at(target)->target && ss->objects.at(target)->target_is_dirty;
+    }
+
+    // Start reading the referent in the background, so that the next
+    // access finds it ready.  Does nothing if it is already in memory.
+    void prefetch(void) const
+    {
+      if (target > 0 && !snap)
+        ss->prefetch(target);
+    }
+
+    // Make the referent part of the resident set being built; see
+    // end_resident_round().  Returns false, and does nothing, if the
+    // set has no room left for it.
+    bool keep_resident(void) const
+    {
+      return target > 0 && !snap && ss->keep_resident(target);
+    }
+
+    // The referent is accounted for by the swap space, not by us.
+    uint64_t footprint(void) const
+    {
+      return sizeof(*this);
     }
 
     void _serialize(std::iostream &fs, serialization_context &context)
     {
       assert(target > 0);
       assert(context.ss.objects.count(target) > 0);
-      fs << target << " ";
-      target = 0;
+      serialize(fs, context, target);
+      if (context.detach)
+        target = 0;
       assert(fs.good());
       context.is_leaf = false;
     }
@@ -450,8 +820,16 @@ public:
     void _deserialize(std::iostream &fs, serialization_context &context)
     {
       assert(target == 0);
+      if (context.snapshot)
+      {
+        ss = NULL;
+        snap = context.snapshot;
+        deserialize(fs, context, target);
+        assert(fs.good());
+        return;
+      }
       ss = &context.ss;
-      fs >> target;
+      deserialize(fs, context, target);
       assert(fs.good());
       assert(context.ss.objects.count(target) > 0);
       // We just created a new reference to this object and
@@ -463,21 +841,25 @@ public:
     Referent *referent;
     swap_space *ss;
     uint64_t target;
+    const swap_snapshot *snap;  // Points into this snapshot instead of ss
 
     // Only callable through swap_space::allocate(...)
     // This creates new pointers and allocates an object in the ss
     pointer(swap_space *sspace, Referent *tgt)
     {
       ss = sspace;
+      snap = NULL;
       target = sspace->next_id++;
 
       object *o = new object(sspace, tgt);
       assert(o != NULL);
       target = o->id;
       assert(ss->objects.count(target) == 0);
+      std::lock_guard<std::mutex> lock(ss->cache_mutex);
       ss->objects[target] = o;
-      ss->lru_pqueue.insert(o);
+      ss->clock_insert(o);
       ss->current_in_memory_objects++;
+      ss->update_footprint(o);
       ss->maybe_evict_something();
     }
   };
@@ -486,60 +868,279 @@ private:
   backing_store *backstore;
 
   uint64_t next_id = 1;
-  uint64_t next_access_time = 0;
 
   class object
   {
   public:
     object(swap_space *sspace, serializable *tgt);
 
-    serializable *target;
+    std::atomic<serializable *> target;
     uint64_t id;
     uint64_t version;
     bool is_leaf;
-    uint64_t refcount;
-    uint64_t last_access;
+    std::atomic<uint64_t> refcount;
     bool target_is_dirty;
-    uint64_t pincount;
-    uint64_t old_version; // This is for copy on write
+    std::atomic<uint64_t> pincount;  // EVICTING while being evicted
+    std::atomic<bool> referenced;    // Pinned since the hand last passed
+    bool loading;                    // Some thread is reading us in
+    uint64_t checkpoint_version; // Version named by the last master record, 0 if none
+    bool snapshot_pending;       // Dirty as of the running checkpoint and not yet written
+    uint64_t resident_round;     // Resident if at least the swap space's resident_round
+
+    // Image of the current version while its write-back is queued
+    std::shared_ptr<const std::string> pending_image;
+
+    // Ring links, only meaningful while in memory
+    object *clock_prev;
+    object *clock_next;
+
+    // Our share of current_in_memory_bytes, 0 while not in memory
+    uint64_t footprint;
+
+    // Evicted into the compressed tier.  image_is_dirty means the
+    // last image that went into the tier is newer than anything on
+    // the backing store; it stays set if the object is loaded again.
+    std::string compressed_image;
+    uint64_t image_length;  // Before compression
+    bool in_compressed_cache;
+    bool image_is_dirty;
+    object *tier_prev;
+    object *tier_next;
   };
 
-  static bool cmp_by_last_access(object *a, object *b);
+  void release_versions(object *obj);
+  void retire_version(uint64_t id, uint64_t version);
+  bool snapshot_needs(uint64_t id, uint64_t version) const;
+  void release_snapshot(swap_snapshot *snapshot);
+  friend class swap_snapshot;
+  uint64_t snapshot_version(object *obj);
+  void update_master_record(void);
+
+  void clock_insert(object *obj);
+  void clock_remove(object *obj);
+  void update_footprint(object *obj);
+  bool over_budget(void) const;
+
+  void evict(object *obj);
+  void compress_image(object *obj, const std::string &image);
+  std::string take_compressed_image(object *obj);
+  void drop_compressed_image(object *obj);
+  void spill_compressed_cache(void);
 
   // ss load - if the object is not in memory (target != null)
-  // bring into memory.
+  // bring into memory.  If another thread is already loading it, wait
+  // for that instead.
    template<class Referent>
-   void load(uint64_t tgt) {
-     assert(objects.count(tgt) > 0);
-     if (objects[tgt]->target == NULL) {
-       object *obj = objects[tgt];
-       debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
-       std::iostream *in = backstore->get(obj->id, obj->version);
-       Referent *r = new Referent();
-       serialization_context ctxt(*this);
-       deserialize(*in, ctxt, *r);
-       backstore->put(in);
-       obj->target = r;
-       current_in_memory_objects++;
-     }
+   void load(object *obj) {
+     if (obj->target != NULL)
+       return;
+     std::unique_lock<std::mutex> lock(cache_mutex);
+     load_finished.wait(lock, [obj] { return !obj->loading; });
+     if (obj->target != NULL)
+       return;
+     obj->loading = true;
+     lock.unlock();
+
+     debug(std::cout << "Loading " << obj->id << " version " << obj->version << std::endl);
+     node_format fmt;
+     std::stringstream in(read_object(obj, fmt));
+     Referent *r = new Referent();
+     serialization_context ctxt(*this, fmt);
+     deserialize(in, ctxt, *r);
+
+     lock.lock();
+     obj->target = r;
+     obj->loading = false;
+     clock_insert(obj);
+     current_in_memory_objects++;
+     update_footprint(obj);
+     load_finished.notify_all();
+     maybe_evict_something();
    }
 
+  // Every stored object image starts with a fixed-size header
+  // describing the payload that follows it.
+  class object_header
+  {
+  public:
+    node_format format;
+    bool is_leaf;
+    uint64_t payload_length;
+    uint32_t checksum;
+  };
+
+  bool read_object_header(std::iostream &in, object_header &hdr);
+  std::string read_object(object *obj, node_format &fmt);
+  std::string check_image(std::stringstream &image, uint64_t id, uint64_t version,
+                          node_format &fmt, bool &is_leaf);
+  std::string read_snapshot_image(const swap_snapshot &snapshot, uint64_t id,
+                                  node_format &fmt, bool &is_leaf);
+
+  // Read the version of object id that snapshot names.  Objects that
+  // hold pointers are kept in the snapshot once read.
+  template<class Referent>
+  static std::shared_ptr<const Referent> read_snapshot_object(const swap_snapshot &snapshot, uint64_t id)
+  {
+    {
+      std::lock_guard<std::mutex> lock(snapshot.cache_mutex);
+      auto it = snapshot.cache.find(id);
+      if (it != snapshot.cache.end())
+        return std::static_pointer_cast<const Referent>(it->second);
+    }
+
+    node_format fmt;
+    bool is_leaf;
+    std::stringstream in(snapshot.ss->read_snapshot_image(snapshot, id, fmt, is_leaf));
+    std::shared_ptr<Referent> r = std::make_shared<Referent>();
+    serialization_context ctxt(*snapshot.ss, fmt);
+    ctxt.snapshot = &snapshot;
+    deserialize(in, ctxt, *r);
+
+    if (!is_leaf)
+    {
+      std::lock_guard<std::mutex> lock(snapshot.cache_mutex);
+      snapshot.cache.emplace(id, r);
+    }
+    return r;
+  }
+  std::string serialize_target(object *obj, bool detach);
+
   void set_cache_size(uint64_t sz);
 
-  void write_back(object *obj);
+  // Marks an object that is being evicted.  Never a real pin count.
+  static const uint64_t EVICTING = 1ULL << 63;
+
+  // Write obj if it is dirty.  Evicting also detaches the pointers in
+  // obj, after which the caller must delete obj->target.
+  void write_back(object *obj, bool evicting);
+  void write_version(object *obj, std::string image);
   void maybe_evict_something(void);
 
-  uint64_t max_in_memory_objects;
-  uint64_t current_in_memory_objects = 0;
+  // A write of one object version, as handed to the write-back pool.
+  class write_back_task
+  {
+  public:
+    uint64_t id;
+    uint64_t version;
+    std::shared_ptr<const std::string> image;
+  };
+
+  // A background read of one object version.  done and image are
+  // protected by prefetch_mutex.
+  class prefetch_slot
+  {
+  public:
+    uint64_t id;
+    uint64_t version;
+    bool done;
+    std::string image;
+  };
+
+  bool keep_resident(uint64_t id);
+
+  void prefetch(uint64_t id);
+  std::shared_ptr<prefetch_slot> take_prefetch(object *obj);
+  std::string wait_for_prefetch(std::shared_ptr<prefetch_slot> slot);
+  void cancel_prefetch(object *obj);
+  void forget_prefetch(uint64_t id);
+  void start_prefetch_threads(unsigned int n);
+  void stop_prefetch_threads(void);
+  void prefetch_worker(void);
+
+  void write_image(uint64_t id, uint64_t version, const std::string &image);
+  void queue_write_back(object *obj, std::shared_ptr<const std::string> image);
+  void wait_for_write_back(uint64_t id);
+  void wait_for_all_write_backs(void);
+  void reap_write_backs(void);
+  void finish_write_back(uint64_t id, uint64_t version);
+  void start_write_back_threads(unsigned int n);
+  void stop_write_back_threads(void);
+  void write_back_worker(void);
+
+  node_format format;
+
+  // Changed under cache_mutex, but read without it to decide whether
+  // to take it.
+  std::atomic<uint64_t> max_in_memory_objects;
+  std::atomic<uint64_t> current_in_memory_objects{0};
+  std::atomic<uint64_t> max_in_memory_bytes{0};
+  std::atomic<uint64_t> current_in_memory_bytes{0};
 
   uint64_t checkpoint_granularity; 
 
+  // The running checkpoint: the LSN and root it was taken at, the
+  // version of each object it names (id -> version), and the objects
+  // that still have to be written for it.
+  bool checkpoint_running = false;
+  uint64_t checkpoint_lsn = 0;
+  uint64_t checkpoint_root = 0;
   std::unordered_map<uint64_t, uint64_t> object_store;
+  std::vector<uint64_t> checkpoint_queue;
+  manifest master_record;
+
+  // Versions of deleted objects that the current master record still
+  // names.  They are freed once the next master record is written.
+  std::vector<std::pair<uint64_t, uint64_t> > dead_versions;
+  // Likewise for the master record of the running checkpoint.
+  std::vector<std::pair<uint64_t, uint64_t> > dead_snapshot_versions;
+
+  // Live snapshots, and versions that nothing but them still names.
+  // Both protected by cache_mutex.
+  std::vector<swap_snapshot *> snapshots;
+  std::vector<std::pair<uint64_t, uint64_t> > retained_versions;
 
   // structs used in ss
   // objects is a map from targets->objects (target == obj->id)
   std::unordered_map<uint64_t, object *> objects;
-  std::set<object *, bool (*)(object *, object *)> lru_pqueue;
+
+  // Protects the ring, the compressed tier and the object state that
+  // loading and eviction change; see the top of this file.
+  std::mutex cache_mutex;
+  std::condition_variable load_finished;
+
+  // In-memory objects, and the next one the hand will look at
+  object *clock_hand = NULL;
+
+  // Objects marked in the current round, or in the one being built
+  // (resident_round + 1), are resident.  Starts at 1 so that
+  // unmarked objects, at 0, are not.
+  uint64_t resident_round = 1;
+  // Size of the set being built
+  uint64_t next_resident_objects = 0;
+  uint64_t next_resident_bytes = 0;
+
+  // Compressed tier, least recently evicted first
+  object *tier_head = NULL;
+  object *tier_tail = NULL;
+  uint64_t compressed_cache_bytes = 0;
+  uint64_t max_compressed_cache_bytes = DEFAULT_COMPRESSED_CACHE_SIZE;
+
+  // Write-back pool.  Everything below is protected by
+  // write_back_mutex; the worker threads touch nothing else in the
+  // swap space except the backing store.
+  std::vector<std::thread> write_back_threads;
+  std::deque<write_back_task> write_back_queue;
+  std::unordered_map<uint64_t, uint64_t> writes_in_flight;         // id -> version, queued or running
+  std::vector<std::pair<uint64_t, uint64_t> > completed_writes;    // Not yet reaped
+  size_t write_back_queue_depth = DEFAULT_WRITE_BACK_QUEUE_DEPTH;
+  bool write_back_stopping = false;
+  bool batching_write_backs = false;   // Under cache_mutex; see checkpoint_step()
+  std::mutex write_back_mutex;
+  std::condition_variable write_back_ready;     // Signals the workers
+  std::condition_variable write_back_finished;  // Signals waiters
+
+  // Prefetch pool.  Everything below is protected by prefetch_mutex.
+  // Only the thread using the swap space adds and removes slots; the
+  // workers just fill them in.
+  std::vector<std::thread> prefetch_threads;
+  std::deque<std::shared_ptr<prefetch_slot> > prefetch_queue;            // Not yet started
+  std::unordered_map<uint64_t, std::shared_ptr<prefetch_slot> > prefetches;  // id -> slot
+  std::deque<uint64_t> prefetch_order;                                   // Keys of prefetches, oldest first
+  size_t prefetch_depth = DEFAULT_PREFETCH_DEPTH;
+  bool prefetch_stopping = false;
+  std::mutex prefetch_mutex;
+  std::condition_variable prefetch_ready;
+  std::condition_variable prefetch_finished;
 };
 
 #endif // SWAP_SPACE_HPP
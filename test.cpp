@@ -6,10 +6,17 @@
 // The program takes 1 command-line parameter -- the number of
 // distinct keys it can use in the test.
 
-// The values in this test are strings.  Since updates use operator+
-// on the values, this test performs concatenation on the strings.
+// The values in this test are strings.  Updates go through the
+// tree's merge operator, which by default uses operator+, so this
+// test performs concatenation on the strings.  With -u counter,
+// updates add to numbers kept as strings instead.
 
 #include <string.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -30,7 +37,7 @@ void timer_stop(uint64_t &timer)
   timer += 1000000*t.tv_sec + t.tv_usec;
 }
 
-int next_command(FILE *input, int *op, uint64_t *arg)
+int next_command(FILE *input, int *op, uint64_t *arg, uint64_t *arg2)
 {
   int ret;
   char command[64];
@@ -61,6 +68,12 @@ int next_command(FILE *input, int *op, uint64_t *arg)
     *op = 5;
   } else if (strcmp(command, "Upper_bound_scan") == 0) {
     *op = 6;
+  } else if (strcmp(command, "Deleting_range") == 0) {
+    *op = 7;
+    if (1 != fscanf(input, " %ld", arg2)) {
+      fprintf(stderr, "Parse error\n");
+      exit(3);
+    }
   } else {
     fprintf(stderr, "Unknown command: %s\n", command);
     exit(1);
@@ -69,10 +82,31 @@ int next_command(FILE *input, int *op, uint64_t *arg)
   return 0;
 }
 
-template<class Key, class Value>
-void do_scan(typename betree<Key, Value>::iterator &betit,
+// Updates add to a count, to test a merge operator other than the
+// default.  Counts are decimal strings.  The empty string, which
+// updates to an absent key start from, counts as 0, and anything
+// after the digits (the ":" in the test's values) is ignored.
+class counter_merge_operator {
+public:
+  static void full_merge(std::string &value, const std::string &delta) {
+    value = std::to_string(strtoull(value.c_str(), NULL, 10) + strtoull(delta.c_str(), NULL, 10));
+  }
+  static void partial_merge(std::string &delta, const std::string &newer) {
+    full_merge(delta, newer);
+  }
+};
+
+// Update the reference as the tree should: one update at a time.
+template<class Tree>
+void reference_update(std::string &value, const std::string &delta)
+{
+  Tree::merge_operator::full_merge(value, delta);
+}
+
+template<class Tree, class Key, class Value>
+void do_scan(typename Tree::iterator &betit,
 	     typename std::map<Key, Value>::iterator &refit,
-	     betree<Key, Value> &b,
+	     Tree &b,
 	     typename std::map<Key, Value> &reference)
 {
   while (refit != reference.end()) {
@@ -88,6 +122,40 @@ void do_scan(typename betree<Key, Value>::iterator &betit,
   assert(betit == b.end());
 }
 
+// Apply batch to the tree, and to the reference one operation at a
+// time, which upsert_batch promises comes to the same.  The script
+// records the operations one at a time too.
+template<class Tree>
+void do_batch(Tree &b,
+	      std::vector<typename Tree::operation> &batch,
+	      std::map<uint64_t, std::string> &reference,
+	      FILE *script_output)
+{
+  b.upsert_batch(batch.begin(), batch.end());
+  for (auto &op : batch) {
+    uint64_t t = std::get<1>(op);
+    switch (std::get<0>(op)) {
+    case INSERT:
+      if (script_output)
+	fprintf(script_output, "Inserting %lu\n", t);
+      reference[t] = std::get<2>(op);
+      break;
+    case UPDATE:
+      if (script_output)
+	fprintf(script_output, "Updating %lu\n", t);
+      reference_update<Tree>(reference[t], std::get<2>(op));
+      break;
+    case DELETE:
+      if (script_output)
+	fprintf(script_output, "Deleting %lu\n", t);
+      reference.erase(t);
+      break;
+    default:
+      abort();
+    }
+  }
+}
+
 #define DEFAULT_TEST_MAX_NODE_SIZE (1ULL<<6)
 #define DEFAULT_TEST_MIN_FLUSH_SIZE (DEFAULT_TEST_MAX_NODE_SIZE / 4)
 #define DEFAULT_TEST_CACHE_SIZE (4)
@@ -103,43 +171,85 @@ void usage(char *name)
     << "Options are" << std::endl
     << "  Required:"   << std::endl
     << "    -d <backing_store_directory>                    [ default: none, parameter is required ]"           << std::endl
-    << "    -m  <mode>  (test or benchmark-<mode>)          [ default: none, parameter required ]"              << std::endl
+    << "    -m  <mode>  (test, test-concurrent or benchmark-<mode>) [ default: none, parameter required ]"     << std::endl
     << "        benchmark modes:"                                                                               << std::endl
     << "          upserts    "                                                                                  << std::endl
+    << "          batch-upserts"                                                                                << std::endl
     << "          queries    "                                                                                  << std::endl
     << "  Betree tuning parameters:" << std::endl
     << "    -N <max_node_size>            (in elements)     [ default: " << DEFAULT_TEST_MAX_NODE_SIZE  << " ]" << std::endl
     << "    -f <min_flush_size>           (in elements)     [ default: " << DEFAULT_TEST_MIN_FLUSH_SIZE << " ]" << std::endl
     << "    -C <max_cache_size>           (in betree nodes) [ default: " << DEFAULT_TEST_CACHE_SIZE     << " ]" << std::endl
+    << "    -M <max_cache_bytes>          (in bytes)        [ default: 0, nodes only ]"                        << std::endl
+    << "    -z <compressed_cache_size>    (in bytes)        [ default: 0, disabled ]"                          << std::endl
+    << "    -l <node_layout>              (map, flat, pool) [ default: map ]"                                   << std::endl
+    << "    -u <merge_operator>   (append or, for map and flat, counter) [ default: append ]"                   << std::endl
+    << "    -b <backing_store>     (files, extent or uring) [ default: files ]"                                 << std::endl
+    << "    -D                            (O_DIRECT for extent and uring stores)"                               << std::endl
+    << "    -B <bloom_bits_per_key>       (an integer)      [ default: 0, no filters ]"                        << std::endl
+    << "    -R <resident_levels>          (in levels)       [ default: 0 ]"                                     << std::endl
+    << "    -P <resident_bytes>           (in bytes)        [ default: 0 ]"                                     << std::endl
+    << "    -F                            (flush in the background)"                                            << std::endl
+    << "    -W <flush_high_watermark>     (in elements)     [ default: 4 * max_node_size ]"                         << std::endl
+    << "    -c <checkpoint_granularity>   (in operations)   [ default: none, no checkpoints ]"                      << std::endl
     << "  Options for both tests and benchmarks" << std::endl
     << "    -k <number_of_distinct_keys>                    [ default: " << DEFAULT_TEST_NDISTINCT_KEYS << " ]" << std::endl
     << "    -t <number_of_operations>                       [ default: " << DEFAULT_TEST_NOPS           << " ]" << std::endl
     << "    -s <random_seed>                                [ default: random ]"                                << std::endl
+    << "    -T <query_threads>   (queries, test-concurrent) [ default: 1 ]"                                     << std::endl
     << "  Test scripting options" << std::endl
     << "    -o <output_script>                              [ default: no output ]"                             << std::endl
     << "    -i <script_file>                                [ default: none ]"                                  << std::endl;
 }
 
-int test(betree<uint64_t, std::string> &b,
+template<class Tree>
+int test(Tree &b,
 	 uint64_t nops,
 	 uint64_t number_of_distinct_keys,
 	 FILE *script_input,
 	 FILE *script_output)
 {
   std::map<uint64_t, std::string> reference;
+  // A snapshot, and what it should hold.  It is taken right after
+  // the first write that a running checkpoint misses, since it has to
+  // take in that write all the same, or else halfway through.
+  std::optional<typename Tree::snapshot> snap;
+  std::map<uint64_t, std::string> snap_reference;
+  bool missed_write = false;
+
+  // Start with every key, as one batch.  With more than about
+  // 0.4 * N * N keys (N the maximum node size), the root leaf splits
+  // into more leaves than one new root can hold, and the new root
+  // splits too.
+  if (!script_input) {
+    std::vector<typename Tree::operation> batch;
+    for (uint64_t t = 0; t < number_of_distinct_keys; t++)
+      batch.push_back(typename Tree::operation(INSERT, t, std::to_string(t) + ":"));
+    do_batch(b, batch, reference, script_output);
+  }
 
   for (unsigned int i = 0; i < nops; i++) {
     int op;
     uint64_t t;
+    uint64_t t2 = 0;
+    if (!script_input && !snap && (missed_write || i == nops / 2)) {
+      snap.emplace(b.take_snapshot());
+      snap_reference = reference;
+    }
+    bool checkpointing = !snap && b.checkpoint_in_progress();
     if (script_input) {
-      int r = next_command(script_input, &op, &t);
+      int r = next_command(script_input, &op, &t, &t2);
       if (r == EOF)
 	exit(0);
       else if (r < 0)
 	exit(4);
     } else {
-      op = rand() % 7;
+      // Range deletes are rare, or they would empty the tree, and
+      // so are batches, which are many operations each.
+      op = rand() % 64;
+      op = op < 62 ? op % 7 : op - 55;
       t = rand() % number_of_distinct_keys;
+      t2 = t + rand() % 32;
     }
     
     switch (op) {
@@ -153,10 +263,7 @@ int test(betree<uint64_t, std::string> &b,
       if (script_output)
 	fprintf(script_output, "Updating %lu\n", t);
       b.update(t, std::to_string(t) + ":");
-      if (reference.count(t) > 0)
-      	reference[t] += std::to_string(t) + ":";
-      else
-      	reference[t] = std::to_string(t) + ":";
+      reference_update<Tree>(reference[t], std::to_string(t) + ":");
       break;
     case 2: // delete
       if (script_output)
@@ -165,17 +272,19 @@ int test(betree<uint64_t, std::string> &b,
       reference.erase(t);
       break;
     case 3: // query
-      try {
-	std::string bval = b.query(t);
-	assert(reference.count(t) > 0);
-	std::string rval = reference[t];
-	assert(bval == rval);
-	if (script_output)
-	  fprintf(script_output, "Query %lu -> %s\n", t, bval.c_str());
-      } catch (std::out_of_range & e) {
-	if (script_output)
-	  fprintf(script_output, "Query %lu -> DNE\n", t);
-	assert(reference.count(t) == 0);
+      {
+	std::optional<std::string> bval = b.try_query(t);
+	if (bval) {
+	  assert(reference.count(t) > 0);
+	  std::string rval = reference[t];
+	  assert(*bval == rval);
+	  if (script_output)
+	    fprintf(script_output, "Query %lu -> %s\n", t, bval->c_str());
+	} else {
+	  if (script_output)
+	    fprintf(script_output, "Query %lu -> DNE\n", t);
+	  assert(reference.count(t) == 0);
+	}
       }
       break;
     case 4: // full scan
@@ -205,9 +314,44 @@ int test(betree<uint64_t, std::string> &b,
 	do_scan(betit, refit, b, reference);
       }
       break;
+    case 7: // range delete
+      if (script_output)
+	fprintf(script_output, "Deleting_range %lu %lu\n", t, t2);
+      b.erase_range(t, t2);
+      reference.erase(reference.lower_bound(t), reference.lower_bound(t2));
+      break;
+    case 8: // batch
+      {
+	// Mixed operations over a narrow window of keys, so that
+	// most batches hold some key more than once.
+	std::vector<typename Tree::operation> batch;
+	uint64_t n = 1 + rand() % 64;
+	for (uint64_t j = 0; j < n; j++) {
+	  uint64_t k = (t + rand() % 16) % number_of_distinct_keys;
+	  int opcode = rand() % 3;  // INSERT, DELETE or UPDATE
+	  batch.push_back(typename Tree::operation(opcode, k, std::to_string(k) + ":"));
+	}
+	do_batch(b, batch, reference, script_output);
+      }
+      break;
     default:
       abort();
     }
+    // A checkpoint that ran before and after the write began before it.
+    bool write = op <= 2 || op >= 7;
+    missed_write = checkpointing && write && b.checkpoint_in_progress();
+  }
+
+  // The writes since must not show through.
+  if (snap) {
+    auto snapit = snap->begin();
+    auto refit = snap_reference.begin();
+    do_scan(snapit, refit, *snap, snap_reference);
+    for (uint64_t t = 0; t < number_of_distinct_keys; t++) {
+      std::optional<std::string> sval = snap->try_query(t);
+      assert(sval ? snap_reference.count(t) > 0 && *sval == snap_reference[t]
+                  : snap_reference.count(t) == 0);
+    }
   }
 
   std::cout << "Test PASSED" << std::endl;
@@ -215,7 +359,114 @@ int test(betree<uint64_t, std::string> &b,
   return 0;
 }
 
-void benchmark_upserts(betree<uint64_t, std::string> &b,
+// Reader threads query and scan the tree while this thread upserts,
+// and check what they see against each key's history.  A read has to
+// see one of the states its keys went through while it ran: this
+// thread counts a write as started just before it makes it and as
+// done just after.
+template<class Tree>
+int test_concurrent(Tree &b,
+		    uint64_t nops,
+		    uint64_t number_of_distinct_keys,
+		    uint64_t random_seed,
+		    unsigned int reader_threads)
+{
+  struct key_history {
+    std::atomic<uint64_t> started{0};
+    std::atomic<uint64_t> done{0};
+    // Every state the key has been in, starting absent
+    std::vector<std::optional<std::string> > states{std::nullopt};
+  };
+  std::vector<key_history> keys(number_of_distinct_keys);
+  std::mutex history_mutex;  // Guards the states
+  std::atomic<bool> stopping{false};
+
+  auto seen = [&](uint64_t k, uint64_t from, uint64_t to, const std::optional<std::string> &v) {
+    std::lock_guard<std::mutex> guard(history_mutex);
+    for (uint64_t version = from; version <= to; version++)
+      if (keys[k].states[version] == v)
+	return true;
+    return false;
+  };
+
+  std::vector<std::thread> readers;
+  for (unsigned int i = 0; i < reader_threads; i++)
+    readers.push_back(std::thread([&, i] {
+      unsigned int seed = random_seed + i + 1;
+      std::vector<uint64_t> from(number_of_distinct_keys);
+      std::vector<std::optional<std::string> > got(number_of_distinct_keys);
+      while (!stopping) {
+	if (rand_r(&seed) % 16) {
+	  uint64_t k = rand_r(&seed) % number_of_distinct_keys;
+	  uint64_t first = keys[k].done;
+	  std::optional<std::string> v = b.try_query(k);
+	  assert(seen(k, first, keys[k].started, v));
+	  continue;
+	}
+
+	// A scan holds the tree for as long as it runs, so it sees
+	// every key as of one moment.  Querying from inside it takes
+	// the tree again, past any writer that is waiting.
+	for (uint64_t k = 0; k < number_of_distinct_keys; k++) {
+	  from[k] = keys[k].done;
+	  got[k].reset();
+	}
+	for (auto it = b.begin(); it != b.end(); ++it) {
+	  got[it.first] = it.second;
+	  if (it.first % 8 == 0) {
+	    std::optional<std::string> v = b.try_query(it.first);
+	    assert(v && *v == it.second);
+	  }
+	}
+	for (uint64_t k = 0; k < number_of_distinct_keys; k++)
+	  assert(seen(k, from[k], keys[k].started, got[k]));
+      }
+    }));
+
+  for (uint64_t i = 0; i < nops; i++) {
+    uint64_t t = rand() % number_of_distinct_keys;
+    int op = rand() % 3;
+    key_history &h = keys[t];
+    std::optional<std::string> next;
+    if (op == 0)
+      next = std::to_string(t) + ":";
+    else if (op == 1) {
+      next = h.states.back().value_or("");
+      reference_update<Tree>(*next, std::to_string(t) + ":");
+    }
+    {
+      std::lock_guard<std::mutex> guard(history_mutex);
+      h.states.push_back(next);
+    }
+    h.started++;
+    if (op == 0)
+      b.insert(t, std::to_string(t) + ":");
+    else if (op == 1)
+      b.update(t, std::to_string(t) + ":");
+    else
+      b.erase(t);
+    h.done++;
+  }
+
+  stopping = true;
+  for (auto &r : readers)
+    r.join();
+
+  std::map<uint64_t, std::string> reference;
+  for (uint64_t k = 0; k < number_of_distinct_keys; k++)
+    if (keys[k].states.back())
+      reference[k] = *keys[k].states.back();
+  auto betit = b.begin();
+  auto refit = reference.begin();
+  do_scan(betit, refit, b, reference);
+
+  std::cout << "Test PASSED" << std::endl;
+
+  return 0;
+}
+
+template<class Tree>
+void benchmark_upserts(Tree &b,
 		       uint64_t nops,
 		       uint64_t number_of_distinct_keys,
 		       uint64_t random_seed)
@@ -237,10 +488,41 @@ void benchmark_upserts(betree<uint64_t, std::string> &b,
   printf("# overall: %ld %ld %f\n", 100*(nops/100), overall_timer, throughput);
 }
 
-void benchmark_queries(betree<uint64_t, std::string> &b,
+// Same workload as benchmark_upserts, but each round goes in as one
+// batch.
+template<class Tree>
+void benchmark_batch_upserts(Tree &b,
+			     uint64_t nops,
+			     uint64_t number_of_distinct_keys,
+			     uint64_t random_seed)
+{
+  uint64_t overall_timer = 0;
+  std::vector<typename Tree::operation> batch;
+  for (uint64_t j = 0; j < 100; j++) {
+    uint64_t timer = 0;
+    timer_start(timer);
+    batch.clear();
+    for (uint64_t i = 0; i < nops / 100; i++) {
+      uint64_t t = rand() % number_of_distinct_keys;
+      batch.push_back(typename Tree::operation(UPDATE, t, std::to_string(t) + ":"));
+    }
+    b.upsert_batch(batch.begin(), batch.end());
+    timer_stop(timer);
+    printf("%ld %ld %ld\n", j, nops/100, timer);
+    overall_timer += timer;
+  }
+
+  double throughput = (1.0*nops*1000000)/overall_timer;
+  printf("# overall: %ld %ld %f\n", 100*(nops/100), overall_timer, throughput);
+}
+
+// With several threads, each one queries its own share of the keys.
+template<class Tree>
+void benchmark_queries(Tree &b,
 		       uint64_t nops,
 		       uint64_t number_of_distinct_keys,
-		       uint64_t random_seed)
+		       uint64_t random_seed,
+		       unsigned int query_threads)
 {
   
   // Pre-load the tree with data
@@ -253,30 +535,91 @@ void benchmark_queries(betree<uint64_t, std::string> &b,
 	// Now go back and query it
   srand(random_seed);
   uint64_t overall_timer = 0;
+  if (query_threads <= 1) {
 	timer_start(overall_timer);
   for (uint64_t i = 0; i < nops; i++) {
     uint64_t t = rand() % number_of_distinct_keys;
     b.query(t);
   }
 	timer_stop(overall_timer);
+  } else {
+    std::vector<uint64_t> keys(nops);
+    for (uint64_t i = 0; i < nops; i++)
+      keys[i] = rand() % number_of_distinct_keys;
+    std::vector<std::thread> threads;
+    timer_start(overall_timer);
+    for (unsigned int i = 0; i < query_threads; i++)
+      threads.push_back(std::thread([&b, &keys, i, query_threads] {
+	for (uint64_t j = i; j < keys.size(); j += query_threads)
+	  b.query(keys[j]);
+      }));
+    for (auto &t : threads)
+      t.join();
+    timer_stop(overall_timer);
+  }
 
   double throughput = (1.0*nops*1000000)/overall_timer;
   printf("# overall: %ld %ld, %f\n", nops, overall_timer, throughput);
 
 }
 
+template<class Tree>
+void run(Tree &b,
+	 const char *mode,
+	 uint64_t nops,
+	 uint64_t number_of_distinct_keys,
+	 uint64_t random_seed,
+	 unsigned int query_threads,
+	 uint64_t bloom_bits_per_key,
+	 uint64_t resident_levels,
+	 uint64_t resident_bytes,
+	 bool background_flushing,
+	 uint64_t flush_high_watermark,
+	 FILE *script_input,
+	 FILE *script_output)
+{
+  b.set_bloom_bits_per_key(bloom_bits_per_key);
+  b.set_resident_levels(resident_levels);
+  b.set_resident_bytes(resident_bytes);
+  b.set_background_flushing(background_flushing);
+  if (flush_high_watermark)
+    b.set_flush_high_watermark(flush_high_watermark);
+  if (strcmp(mode, "test") == 0) 
+    test(b, nops, number_of_distinct_keys, script_input, script_output);
+  else if (strcmp(mode, "test-concurrent") == 0)
+    test_concurrent(b, nops, number_of_distinct_keys, random_seed, query_threads);
+  else if (strcmp(mode, "benchmark-upserts") == 0)
+    benchmark_upserts(b, nops, number_of_distinct_keys, random_seed);
+  else if (strcmp(mode, "benchmark-batch-upserts") == 0)
+    benchmark_batch_upserts(b, nops, number_of_distinct_keys, random_seed);
+  else if (strcmp(mode, "benchmark-queries") == 0)
+    benchmark_queries(b, nops, number_of_distinct_keys, random_seed, query_threads);
+}
+
 int main(int argc, char **argv)
 {
   char *mode = NULL;
   uint64_t max_node_size = DEFAULT_TEST_MAX_NODE_SIZE;
   uint64_t min_flush_size = DEFAULT_TEST_MIN_FLUSH_SIZE;
   uint64_t cache_size = DEFAULT_TEST_CACHE_SIZE;
+  uint64_t cache_bytes = 0;
+  uint64_t compressed_cache_size = 0;
+  const char *node_layout = "map";
+  const char *merge_operator = "append";
+  const char *store_type = "files";
+  bool direct_io = false;
+  uint64_t bloom_bits_per_key = 0;
+  uint64_t resident_levels = 0;
+  uint64_t resident_bytes = 0;
+  bool background_flushing = false;
+  uint64_t flush_high_watermark = 0;
   char *backing_store_dir = NULL;
   uint64_t number_of_distinct_keys = DEFAULT_TEST_NDISTINCT_KEYS;
   uint64_t nops = DEFAULT_TEST_NOPS;
   char *script_infile = NULL;
   char *script_outfile = NULL;
   unsigned int random_seed = time(NULL) * getpid();
+  unsigned int query_threads = 1;
  
   int opt;
   char *term;
@@ -287,7 +630,7 @@ int main(int argc, char **argv)
   // Argument parsing //
   //////////////////////
   
-  while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:")) != -1) {
+  while ((opt = getopt(argc, argv, "m:d:N:f:C:M:z:l:b:DB:R:P:FW:c:u:o:k:t:s:T:i:")) != -1) {
     switch (opt) {
     case 'm':
       mode = optarg;
@@ -319,6 +662,94 @@ int main(int argc, char **argv)
 	exit(1);
       }
       break;
+    case 'B':
+      bloom_bits_per_key = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -B must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'R':
+      resident_levels = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -R must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'P':
+      resident_bytes = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -P must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'M':
+      cache_bytes = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -M must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'z':
+      compressed_cache_size = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -z must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'l':
+      node_layout = optarg;
+      if (strcmp(node_layout, "map") != 0 && strcmp(node_layout, "flat") != 0 &&
+	  strcmp(node_layout, "pool") != 0) {
+	std::cerr << "Argument to -l must be \"map\", \"flat\" or \"pool\"" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'u':
+      merge_operator = optarg;
+      if (strcmp(merge_operator, "append") != 0 && strcmp(merge_operator, "counter") != 0) {
+	std::cerr << "Argument to -u must be \"append\" or \"counter\"" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'b':
+      store_type = optarg;
+      if (strcmp(store_type, "files") != 0 && strcmp(store_type, "extent") != 0 &&
+	  strcmp(store_type, "uring") != 0) {
+	std::cerr << "Argument to -b must be \"files\", \"extent\" or \"uring\"" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'D':
+      direct_io = true;
+      break;
+    case 'F':
+      background_flushing = true;
+      break;
+    case 'W':
+      flush_high_watermark = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -W must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'c':
+      checkpoint_granularity = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -c must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
     case 'o':
       script_outfile = optarg;
       break;
@@ -346,6 +777,14 @@ int main(int argc, char **argv)
 	exit(1);
       }
       break;
+    case 'T':
+      query_threads = strtoul(optarg, &term, 10);
+      if (*term || query_threads == 0) {
+	std::cerr << "Argument to -T must be a positive integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
     case 'i':
       script_infile = optarg;
       break;
@@ -361,7 +800,9 @@ int main(int argc, char **argv)
 
   if (mode == NULL ||
       (strcmp(mode, "test") != 0
+       && strcmp(mode, "test-concurrent") != 0
        && strcmp(mode, "benchmark-upserts") != 0
+       && strcmp(mode, "benchmark-batch-upserts") != 0
 			 && strcmp(mode, "benchmark-queries") != 0)) {
     std::cerr << "Must specify a mode of \"test\" or \"benchmark\"" << std::endl;
     usage(argv[0]);
@@ -409,21 +850,42 @@ int main(int argc, char **argv)
   // Construct a betree and run the tests or benchmarks //
   ////////////////////////////////////////////////////////
   
-  one_file_per_object_backing_store ofpobs(backing_store_dir);
-  // swap_space sspace(&ofpobs, cache_size);
-  swap_space sspace(&ofpobs, cache_size, checkpoint_granularity);
+  std::unique_ptr<backing_store> store;
+  if (strcmp(store_type, "extent") == 0)
+    store.reset(new single_file_backing_store(backing_store_dir, direct_io));
+  else if (strcmp(store_type, "uring") == 0)
+    store.reset(new uring_backing_store(backing_store_dir, direct_io));
+  else
+    store.reset(new one_file_per_object_backing_store(backing_store_dir));
+  // swap_space sspace(store.get(), cache_size);
+  swap_space sspace(store.get(), cache_size, checkpoint_granularity);
+  sspace.set_cache_bytes(cache_bytes);
+  sspace.set_compressed_cache_size(compressed_cache_size);
 
-  Logger logger(&ofpobs, persistence_granularity, checkpoint_granularity); // Initialze Logger here
+  Logger logger(store.get(), persistence_granularity, checkpoint_granularity); // Initialze Logger here
 
-  // betree<uint64_t, std::string> b(&sspace, max_node_size, min_flush_size);
-  betree<uint64_t, std::string> b(&sspace, &logger, max_node_size, min_flush_size);
+  if (strcmp(merge_operator, "counter") == 0 && strcmp(node_layout, "pool") == 0) {
+    std::cerr << "The counter merge operator works with the map and flat layouts" << std::endl;
+    usage(argv[0]);
+    exit(1);
+  }
 
-  if (strcmp(mode, "test") == 0) 
-    test(b, nops, number_of_distinct_keys, script_input, script_output);
-  else if (strcmp(mode, "benchmark-upserts") == 0)
-    benchmark_upserts(b, nops, number_of_distinct_keys, random_seed);
-  else if (strcmp(mode, "benchmark-queries") == 0)
-    benchmark_queries(b, nops, number_of_distinct_keys, random_seed);
+  if (strcmp(merge_operator, "counter") == 0 && strcmp(node_layout, "flat") == 0) {
+    betree<uint64_t, std::string, flat_node_layout, counter_merge_operator> b(&sspace, &logger, max_node_size, max_node_size / 4, min_flush_size);
+    run(b, mode, nops, number_of_distinct_keys, random_seed, query_threads, bloom_bits_per_key, resident_levels, resident_bytes, background_flushing, flush_high_watermark, script_input, script_output);
+  } else if (strcmp(merge_operator, "counter") == 0) {
+    betree<uint64_t, std::string, map_node_layout, counter_merge_operator> b(&sspace, &logger, max_node_size, max_node_size / 4, min_flush_size);
+    run(b, mode, nops, number_of_distinct_keys, random_seed, query_threads, bloom_bits_per_key, resident_levels, resident_bytes, background_flushing, flush_high_watermark, script_input, script_output);
+  } else if (strcmp(node_layout, "flat") == 0) {
+    betree<uint64_t, std::string, flat_node_layout> b(&sspace, &logger, max_node_size, max_node_size / 4, min_flush_size);
+    run(b, mode, nops, number_of_distinct_keys, random_seed, query_threads, bloom_bits_per_key, resident_levels, resident_bytes, background_flushing, flush_high_watermark, script_input, script_output);
+  } else if (strcmp(node_layout, "pool") == 0) {
+    betree<uint64_t, std::string, pooled_node_layout> b(&sspace, &logger, max_node_size, max_node_size / 4, min_flush_size);
+    run(b, mode, nops, number_of_distinct_keys, random_seed, query_threads, bloom_bits_per_key, resident_levels, resident_bytes, background_flushing, flush_high_watermark, script_input, script_output);
+  } else {
+    betree<uint64_t, std::string> b(&sspace, &logger, max_node_size, max_node_size / 4, min_flush_size);
+    run(b, mode, nops, number_of_distinct_keys, random_seed, query_threads, bloom_bits_per_key, resident_levels, resident_bytes, background_flushing, flush_high_watermark, script_input, script_output);
+  }
   
   if (script_input)
     fclose(script_input);
@@ -10,6 +10,7 @@
 // on the values, this test performs concatenation on the strings.
 
 #include <string.h>
+#include <memory>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -33,7 +34,7 @@ void timer_stop(uint64_t &timer) {
     timer += 1000000 * t.tv_sec + t.tv_usec;
 }
 
-int next_command(FILE *input, int *op, uint64_t *arg) {
+int next_command(FILE *input, int *op, uint64_t *arg, uint64_t *arg2) {
     int ret;
     char command[64];
 
@@ -57,6 +58,12 @@ int next_command(FILE *input, int *op, uint64_t *arg) {
             fprintf(stderr, "Parse error\n");
             exit(3);
         }
+    } else if (strcmp(command, "Deleting_range") == 0) {
+        *op = 4;
+        if (1 != fscanf(input, " %ld", arg2)) {
+            fprintf(stderr, "Parse error\n");
+            exit(3);
+        }
     } else {
         fprintf(stderr, "Unknown command: %s\n", command);
         exit(1);
@@ -94,6 +101,22 @@ void usage(char *name) {
         << DEFAULT_TEST_MIN_FLUSH_SIZE << " ]" << std::endl
         << "    -C <max_cache_size>           (in betree nodes) [ default: "
         << DEFAULT_TEST_CACHE_SIZE << " ]" << std::endl
+        << "    -M <max_cache_bytes>          (in bytes)        [ default: "
+           "0, nodes only ]"
+        << std::endl
+        << "    -z <compressed_cache_size>    (in bytes)        [ default: "
+           "0, disabled ]"
+        << std::endl
+        << "    -b <backing_store>     (files, extent or uring) [ default: "
+           "files ]"
+        << std::endl
+        << "    -D                            (O_DIRECT for extent and uring stores)"
+        << std::endl
+        << "    -B <bloom_bits_per_key>       (an integer)      [ default: "
+           "0, no filters ]"
+        << std::endl
+        << "    -G <manifest_min_compact_bytes> (in bytes)      [ default: "
+        << MANIFEST_MIN_COMPACT_BYTES << " ]" << std::endl
         << "  Options for both tests and benchmarks" << std::endl
         << "    -k <number_of_distinct_keys>                    [ default: "
         << DEFAULT_TEST_NDISTINCT_KEYS << " ]" << std::endl
@@ -122,15 +145,18 @@ int test(betree<uint64_t, std::string> &b, uint64_t nops,
         printf("%u/%lu\n", i, nops);
         int op;
         uint64_t t;
+        uint64_t t2 = 0;
         if (script_input) {
-            int r = next_command(script_input, &op, &t);
+            int r = next_command(script_input, &op, &t, &t2);
             if (r == EOF)
                 exit(0);
             else if (r < 0)
                 exit(4);
         } else {
-            op = rand() % 4;
+            op = rand() % 64;
+            op = op < 63 ? op % 4 : 4;
             t = rand() % number_of_distinct_keys;
+            t2 = t + rand() % 32;
         }
 
         switch (op) {
@@ -150,16 +176,22 @@ int test(betree<uint64_t, std::string> &b, uint64_t nops,
                 b.erase(t);
                 break;
             case 3:  // query
-                try {
-                    std::string bval = b.query(t);
-                    if (script_output)
-                        fprintf(script_output, "Query %lu -> %s\n", t,
-                                bval.c_str());
-                } catch (std::out_of_range & e) {
-                    if (script_output)
-                        fprintf(script_output, "Query %lu -> DNE\n", t);
+                {
+                    std::optional<std::string> bval = b.try_query(t);
+                    if (script_output) {
+                        if (bval)
+                            fprintf(script_output, "Query %lu -> %s\n", t,
+                                    bval->c_str());
+                        else
+                            fprintf(script_output, "Query %lu -> DNE\n", t);
+                    }
                 }
                 break;
+            case 4:  // range delete
+                if (script_output)
+                    fprintf(script_output, "Deleting_range %lu %lu\n", t, t2);
+                b.erase_range(t, t2);
+                break;
             default:
                 abort();
         }
@@ -213,12 +245,18 @@ int main(int argc, char **argv) {
     uint64_t max_node_size = DEFAULT_TEST_MAX_NODE_SIZE;
     uint64_t min_flush_size = DEFAULT_TEST_MIN_FLUSH_SIZE;
     uint64_t cache_size = DEFAULT_TEST_CACHE_SIZE;
+    uint64_t cache_bytes = 0;
+    uint64_t compressed_cache_size = 0;
     char *backing_store_dir = NULL;
+    const char *store_type = "files";
+    bool direct_io = false;
     uint64_t number_of_distinct_keys = DEFAULT_TEST_NDISTINCT_KEYS;
     uint64_t nops = DEFAULT_TEST_NOPS;
     char *script_infile = NULL;
     char *script_outfile = NULL;
     unsigned int random_seed = time(NULL) * getpid();
+    uint64_t bloom_bits_per_key = 0;
+    uint64_t manifest_min_compact_bytes = MANIFEST_MIN_COMPACT_BYTES;
 
     // REQUIRED PARAMETERS FOR PERSISTENCE AND CHECKPOINTING GRANULARITY
     uint64_t persistence_granularity = UINT64_MAX;
@@ -231,7 +269,7 @@ int main(int argc, char **argv) {
     // Argument parsing //
     //////////////////////
 
-    while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:p:c:")) != -1) {
+    while ((opt = getopt(argc, argv, "m:d:N:f:C:M:z:b:DB:G:o:k:t:s:i:p:c:")) != -1) {
         switch (opt) {
             case 'm':
                 mode = optarg;
@@ -266,6 +304,38 @@ int main(int argc, char **argv) {
                     exit(1);
                 }
                 break;
+            case 'M':
+                cache_bytes = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -M must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'z':
+                compressed_cache_size = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -z must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                store_type = optarg;
+                if (strcmp(store_type, "files") != 0 &&
+                    strcmp(store_type, "extent") != 0 &&
+                    strcmp(store_type, "uring") != 0) {
+                    std::cerr << "Argument to -b must be \"files\", \"extent\" or \"uring\""
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'D':
+                direct_io = true;
+                break;
             case 'o':
                 script_outfile = optarg;
                 break;
@@ -309,6 +379,24 @@ int main(int argc, char **argv) {
                     exit(1);
                 }
                 break;
+            case 'B':
+                bloom_bits_per_key = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -B must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'G':
+                manifest_min_compact_bytes = strtoull(optarg, &term, 10);
+                if (*term) {
+                    std::cerr << "Argument to -G must be an integer"
+                              << std::endl;
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
             case 'c':
                 // checkpoint granularity
                 checkpoint_granularity = strtoull(optarg, &term, 10);
@@ -396,15 +484,25 @@ int main(int argc, char **argv) {
     // Construct a betree and run the tests or benchmarks //
     ////////////////////////////////////////////////////////
 
-    one_file_per_object_backing_store ofpobs(backing_store_dir);
+    std::unique_ptr<backing_store> store;
+    if (strcmp(store_type, "extent") == 0)
+        store.reset(new single_file_backing_store(backing_store_dir, direct_io));
+    else if (strcmp(store_type, "uring") == 0)
+        store.reset(new uring_backing_store(backing_store_dir, direct_io));
+    else
+        store.reset(new one_file_per_object_backing_store(backing_store_dir));
 
     //ofpobs.reset_ids();
 
-    swap_space sspace(&ofpobs, cache_size, checkpoint_granularity);
+    swap_space sspace(store.get(), cache_size, checkpoint_granularity);
+    sspace.set_cache_bytes(cache_bytes);
+    sspace.set_compressed_cache_size(compressed_cache_size);
+    sspace.set_manifest_min_compact_bytes(manifest_min_compact_bytes);
 
-    Logger logger(&ofpobs, persistence_granularity, checkpoint_granularity); // Initialze Logger here
+    Logger logger(store.get(), persistence_granularity, checkpoint_granularity); // Initialze Logger here
 
-    betree<uint64_t, std::string> b(&sspace, &logger, max_node_size, min_flush_size); // Add Logger pointer in betree constuctor
+    betree<uint64_t, std::string> b(&sspace, &logger, max_node_size, max_node_size / 4, min_flush_size); // Add Logger pointer in betree constuctor
+    b.set_bloom_bits_per_key(bloom_bits_per_key);
     
     // Recovery<uint64_t, std::string> recovery(&ofpobs, &sspace, &logger, &b);
     // recovery.recover();
@@ -0,0 +1,122 @@
+// On-disk format of write-ahead log records.
+
+// The log is a sequence of records, each laid out as
+//
+//   u32 crc32c     of everything after this field
+//   u32 length     of the body
+//   body:
+//     u64 lsn
+//     u8  opcode
+//     u64 key
+//     u32 value length
+//     value bytes
+//
+// All integers are little-endian.  A record whose length runs past
+// the end of the file, or whose checksum does not match, marks a torn
+// write at the tail of the log: recovery stops there.
+
+#ifndef WAL_FORMAT_HPP
+#define WAL_FORMAT_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <fstream>
+#include "encoding.hpp"
+#include "crc32c.hpp"
+
+// The log is kept in two files that take turns (see logger.hpp).
+// Records are replayed from the one whose first record is older
+// first.
+#define WAL_FILENAME "wal_log.txt"
+#define WAL_ALT_FILENAME "wal_log_alt.txt"
+
+#define WAL_RECORD_HEADER_SIZE (8)
+#define WAL_RECORD_BODY_FIXED_SIZE (8 + 1 + 8 + 4)
+
+// Anything larger than this is treated as garbage rather than as a
+// record we have not finished reading.
+#define WAL_MAX_RECORD_SIZE (64 * 1024 * 1024)
+
+struct wal_record {
+  uint64_t lsn;
+  int opcode;
+  uint64_t key;
+  const char *value;
+  uint32_t value_length;
+};
+
+enum wal_decode_status {
+  WAL_RECORD_OK,
+  WAL_RECORD_INCOMPLETE,  // Need more bytes
+  WAL_RECORD_CORRUPT
+};
+
+inline void encode_wal_record(std::string &dst, uint64_t lsn, int opcode,
+                              uint64_t key, const std::string &value)
+{
+  size_t start = dst.size();
+  uint32_t body_length = WAL_RECORD_BODY_FIXED_SIZE + value.size();
+  put_fixed32(dst, 0);  // crc, filled in below
+  put_fixed32(dst, body_length);
+  put_fixed64(dst, lsn);
+  dst.push_back((char)opcode);
+  put_fixed64(dst, key);
+  put_fixed32(dst, value.size());
+  dst.append(value);
+  uint32_t crc = crc32c(dst.data() + start + 4, dst.size() - start - 4);
+  encode_fixed32(&dst[start], crc);
+}
+
+// Decode the record at the start of buf.  On success, rec.value
+// points into buf and *consumed is the size of the record.
+inline wal_decode_status decode_wal_record(const char *buf, size_t avail,
+                                           wal_record &rec, size_t *consumed)
+{
+  if (avail < WAL_RECORD_HEADER_SIZE)
+    return WAL_RECORD_INCOMPLETE;
+  uint32_t crc = decode_fixed32(buf);
+  uint32_t body_length = decode_fixed32(buf + 4);
+  if (body_length < WAL_RECORD_BODY_FIXED_SIZE || body_length > WAL_MAX_RECORD_SIZE)
+    return WAL_RECORD_CORRUPT;
+  if (avail < WAL_RECORD_HEADER_SIZE + body_length)
+    return WAL_RECORD_INCOMPLETE;
+  if (crc32c(buf + 4, 4 + body_length) != crc)
+    return WAL_RECORD_CORRUPT;
+
+  const char *body = buf + WAL_RECORD_HEADER_SIZE;
+  rec.lsn = decode_fixed64(body);
+  rec.opcode = (unsigned char)body[8];
+  rec.key = decode_fixed64(body + 9);
+  rec.value_length = decode_fixed32(body + 17);
+  rec.value = body + WAL_RECORD_BODY_FIXED_SIZE;
+  if (WAL_RECORD_BODY_FIXED_SIZE + rec.value_length != body_length)
+    return WAL_RECORD_CORRUPT;
+  *consumed = WAL_RECORD_HEADER_SIZE + body_length;
+  return WAL_RECORD_OK;
+}
+
+// Find the LSN of the first record in the log file at path.  Returns
+// false if the file is missing or does not start with a good record.
+inline bool read_first_wal_lsn(const char *path, uint64_t &lsn)
+{
+  std::ifstream in(path, std::ios::binary);
+  char header[WAL_RECORD_HEADER_SIZE];
+  if (!in.read(header, sizeof(header)))
+    return false;
+  uint32_t body_length = decode_fixed32(header + 4);
+  if (body_length > WAL_MAX_RECORD_SIZE)
+    return false;
+  std::string record(header, sizeof(header));
+  record.resize(sizeof(header) + body_length);
+  if (!in.read(&record[sizeof(header)], body_length))
+    return false;
+  wal_record rec;
+  size_t consumed;
+  if (decode_wal_record(record.data(), record.size(), rec, &consumed) != WAL_RECORD_OK)
+    return false;
+  lsn = rec.lsn;
+  return true;
+}
+
+#endif // WAL_FORMAT_HPP